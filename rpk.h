@@ -1,500 +1,3164 @@
-/* Rapid Picture Kompressor
- * Fast, lossless image comprehension inspired by work on QOI/QOIG.
- * The goal here is to be faster and simpler than QOI while still
- * doing "okay" at compressing.
- * 
- * The header is identical to that of QOI/QOIG, with the sole change
- * that the magic string is "RPK" instead of "QOIF".
- * 
- * The footer is also identical to that of QOI. (7 0 bytes and a 1 byte)
- * 
- * However, the compression algorithm is entirely different. On the highest
- * level there are only two kinds of operations: INDEX and RUN. The MSB of
- * the op byte encodes which of these two ops is being used.
- * 
- * 1. INDEX
- * 
- * ┌─ OP_INDEX ─────────────┐
- * │         Byte[0]        │
- * │ 7  6  5  4  3  2  1  0 │
- * │───┼────────────────────│
- * │ 0 │        index       │
- * └───┴────────────────────┘
- * 
- * There is a 128-color cache. If the op byte is less than 128, it is used
- * as an index into this cache and the color in that slot is inserted directly
- * into the output.
- * 
- * Every pixel encoded/decoded has its color inserted into the cache at the
- * position given by the hash function:
- *       ((((88 ^ red)*13 ^ green)*13 ^ blue)*13 ^ alpha) & 127
- * (This is essentially FNV-1a adapted to have decent dispersion over the range
- * 0-127.)
- * 
- * 2. RUN
- * 
- * ┌─ OP_RUN ───────────────┐
- * │         Byte[0]        │
- * │ 7  6  5  4  3  2  1  0 │
- * │───┼─────┼──────────────│
- * │ 1 │ type│   length     │
- * └───┴─────┴──────────────┘
- * 
- * One could think of RUN as being four different operations, but they all start
- * with the same structure as above. They all indicate that a modification of the
- * previous color should be inserted some number of times in a row. The "type" 
- * argument can be thought of as "how many bytes to read per color." But we'll
- * look at the four types separately and individually here:
- * 
- * ┌─ OP_RUN_TYPE_0 ────────┬────────────────────────┬────────────────────────┐
- * │         Byte[0]        │     Byte[1] (maybe)    │     Byte[2] (maybe)    │
- * │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │
- * │─────────┼──────────────┼────────────────────────┼────────────────────────│
- * │ 1  0  0 │                             length                             │
- * └─────────┴──────────────┴────────────────────────┴────────────────────────┘
- * 
- * Run type 0 encodes a run of identical pixels, using up to 2 additional bytes
- * to encode the length of the run. To be precise, here's how the allowed lengths
- * are encoded:
- * 
- *               Length range          Code range         Total bytes
- * ───────────────────────────┼───────────────────┼──────────────────
- *                    1 to 16 │         0x80-0x8F │                 1
- *             17 to 2**11+16 │     0x9000-0x97FF │                 2
- * 2**11+17 to 2**19+2**11+16 │ 0x980000-0x9FFFFF │                 3
- * 
- * Bits 3 and 4 of the first byte signal whether additional bytes should be read.
- * 
- * Run types 1, 2, and 3 do not use any additional bytes to encode a longer run length.
- * They use only the length indicated by the op byte with a bias of 1 to indicate
- * a run of length 1 to 32.
- * 
- * Run type 1 will read an additional (length) bytes, each encoding an operation to
- * be applied to the previous color to compute the next. These bytes are parsed thusly:
- * 
- * ┌─ OP_RUN_TYPE_1_ARG ────┐
- * │         Byte[0]        │
- * │ 7  6  5  4  3  2  1  0 │
- * │──────┼─────┼─────┼─────│
- * │  dr  │ dg  │ db  │ da  │
- * └──────┴─────┴─────┴─────┘
- * 
- * The new color is computed by xoring each pair of bits with the least significant
- * two bits of the corresponding component. E.g. newred = oldred ^ dr
- * 
- * For a 3-channel image, the da bits should always be zeroed.
- * 
- * Run type 2 will similarly read an additional (2*length) bytes, 2 bytes per new color.
- * 
- * ┌─ OP_RUN_TYPE_2_ARG ────┬────────────────────────┐
- * │         Byte[0]        │         Byte[1]        │
- * │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │
- * │───────────────┼────────┼─────────┼──────────────│
- * │       dr      │        dg        │      db      │
- * └───────────────┴──────────────────┴──────────────┘
- * 
- * The new color is computed by xoring each group of bits with the least significant
- * corresponding bits of the corresponding component, exactly as per run type 1.
- * 
- * Run type 3 will similarly read an additional (channels*length) bytes, (channels) per new color.
- * 
- * ┌─ OP_RUN_TYPE_3_ARG ────┬────────────────────────┬────────────────────────┬────────────────────────┐
- * │         Byte[0]        │         Byte[1]        │         Byte[2]        │Byte[3] (iff channels=4)│
- * │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │
- * │────────────────────────┼────────────────────────┼────────────────────────┼────────────────────────│
- * │          red           │         green          │          blue          │         alpha          │
- * └────────────────────────┴────────────────────────┴────────────────────────┴────────────────────────┘
- * 
- * To save an operation when computing the next color, the color encoded by these bytes is precisely the
- * next color.
- * 
- * For a 3-channel image, the fourth byte *should be omitted entirely*.
- * 
- * Compression proceeds exactly one would expect: If the next color matches the previous, a run type 0 is set up.
- * Otherwise, if the next color is in the cache, an INDEX op is output. If not, the next and previous colors are
- * xored. If the result has only the least significant bits set, runs of type 1 or 2 is set up. Otherwise, a run 
- * of type 3 is set up. If a run has already been set up and the result of the comparison indicates the same
- * type of run again, the length of the run is extended and any arguments it will need are added to the buffer. If
- * the run type changes or an index becomes possible, the RUN op is output followed by all the buffered arguments.
- * 
- * There are two small exceptions to this scheme: Runs of type 1 will NOT be interrupted to output an INDEX. Likewise,
- * type two runs are NOT interrupted to begin a type 1 run. (Type 1 runs tend to be very short, so this is more likely
- * to cost an extra byte than not.)
- */
-#include <stdlib.h>
-#include <string.h>
-#include <arpa/inet.h>
-
-//Uses libspng with miniz
-#define SPNG_STATIC
-#define SPNG_USE_MINIZ
-#include "spng.h"
-
-#define RPK_SRBG 0
-#define LRS(a,b) ((unsigned)(a)>>(b))
-#define RPK_READ(a,b,c,d) if (fread(a,b,c,d)!=c) return -1
-#define HASH(C) (((((88^C.red)*13^C.green)*13^C.blue)*13^C.alpha)&127)
-#define EQCOLOR(a,b) (a.rgba == b.rgba)
-#define PACKRUN(type,length) (128+((type)<<5)+(length))
-#define MIN(a,b) ((a)>(b)?(b):(a))
-#define RPK_PRINT(b)  if (run) {\
-                          if (runtype) {\
-                              fprintf(outfile,"%c",PACKRUN(runtype,run-1));\
-                              fwrite(buffer,1,MIN(1<<(runtype-1),channels)*run,outfile);\
-                              ct+=MIN(1<<(runtype-1),channels)*run+1;\
-                              runtype = -1;\
-                          } else {\
-                              if (run<=16) {\
-                                  fprintf(outfile,"%c",PACKRUN(runtype,run-1));\
-                                  ct++;\
-                              } else {\
-                                  run-=17;\
-                                  if (run<1<<11) {\
-                                      fprintf(outfile,"%c%c",PACKRUN(runtype,16+LRS(run,8)),run&0xFF);\
-                                      ct+=2;\
-                                  } else {\
-                                      run-=1<<11;\
-                                      fprintf(outfile,"%c%c%c",PACKRUN(runtype,24+LRS(run,16)),LRS(run,8)&0xFF,run&0xFF);\
-                                      ct+=3;\
-                                  }\
-                              }\
-                          }\
-                      }\
-                      if (b<128) {\
-                        fprintf(outfile,"%c",b);\
-                        ct++;\
-                      }\
-                      run = 0
-
-typedef union {
-    uint32_t rgba;
-    struct {
-        unsigned char red;
-        unsigned char green;
-        unsigned char blue;
-        unsigned char alpha;
-    };
-} color;
-
-typedef struct {
-	uint32_t width;
-	uint32_t height;
-	uint8_t channels;
-	uint8_t colorspace;
-} rpk_desc;
-
-
-
-int rpk_encode(spng_ctx *ctx, size_t width, FILE *outfile, unsigned long *outlen, uint8_t channels) {
-    color cache[128] = {0};
-    color row[width];
-    color last,diff;
-    color current = (color){.alpha=255};
-    color type2mask = (color){.red = 0xE0,.green = 0xC0,.blue = 0xE0,.alpha=0xFF};
-    uint8_t buffer[128];
-    unsigned int i;
-    uint8_t runtype = -1;
-    uint8_t lastrow = 0;
-    uint8_t ret,done;
-    uint32_t run = 0;
-    unsigned long ct = 0;
-    //int rows_read = 0;
-    
-    
-    /*spng_decode_row is a bad API. a sane API would return 0 after every successful read*/
-    while (!(ret = spng_decode_row(ctx, row, 4*width)) || lastrow && ret == SPNG_EOI) {
-        done = ret == SPNG_EOI && !lastrow;
-        lastrow = !ret;
-        for (i=0;i<width;i+=1) {
-            
-            last = current;
-            
-            //Get next pixel
-
-            current=row[i];
-            
-            if (EQCOLOR(current,last)) {
-                if (!runtype && run<526352) {
-                    run++;
-                } else {
-                    RPK_PRINT(128);
-                    run=1;
-                    runtype=0;
-                }
-                continue;
-            }
-            diff.rgba = current.rgba^last.rgba;
-            if (!(diff.rgba&0xFCFCFCFC) && run && runtype==1) goto smalldiff;
-                
-            if (EQCOLOR(current,cache[HASH(current)])) {
-                RPK_PRINT(HASH(current));
-            } else {
-                if (!(diff.rgba&0xFCFCFCFC) && runtype!=2) {
-                    if (run && runtype!=1 || run==32) {
-                        RPK_PRINT(128);
-                        run=0;
-                    }
-                    smalldiff:buffer[run++]=(diff.alpha|diff.blue<<2|diff.green<<4|diff.red<<6)&0xFF;
-                    runtype=1;
-                } else if (!(diff.rgba&type2mask.rgba)) {
-                    if (run && runtype!=2 || run==32) {
-                        RPK_PRINT(128);
-                        run=0;
-                    }
-                    buffer[run*2]=(diff.red<<3|LRS(diff.green,3))&0xFF;
-                    buffer[run*2+1]=(diff.green<<5|diff.blue&0x1F)&0xFF;
-                    run++;
-                    runtype=2;
-                } else {
-                    if (run && runtype!=3 || run==32) {
-                        RPK_PRINT(128);
-                        run=0;
-                    }
-                    buffer[run*channels]=current.red;
-                    buffer[run*channels+1]=current.green;
-                    buffer[run*channels+2]=current.blue;
-                    if (channels==4) buffer[run*4+3]=current.alpha;
-                    run++;
-                    runtype=3;
-                }
-                cache[HASH(current)]=current;
-            }
-        }
-        //rows_read++;
-    }
-    //Flush all buffers
-    RPK_PRINT(0);
-    
-    *outlen = ct;
-    return 0;
-}
-
-int rpk_decode(FILE *infile, size_t width, spng_ctx *ctx, size_t *outlen, uint8_t channels) {
-    color cache[128] = {0};
-    color current = (color){.alpha=255};
-    color temp;
-    unsigned int i;
-    uint8_t cbyte = 0;
-    uint8_t tempbyte = 0;
-    uint8_t runtype;
-    uint32_t run=0;
-    uint8_t row[width*channels];
-    //unsigned int rows_read = 0;
-    int ret;
-    *outlen = 0;
-    
-    do { 
-        for (i=0;i<channels*width;i+=channels) {
-            if (run) goto runcont; 
-            RPK_READ(&cbyte,1,1,infile);
-            switch(cbyte&0x80) {
-                case 0:
-                    current = cache[cbyte];
-                    break;
-                case 0x80:
-                    if (!run) {
-                        runtype = LRS(cbyte&0x60,5);
-                        run = (cbyte&0x1F);
-                        if (!runtype) {
-                            if (run>=16) {
-                                run &= 15;
-                                if (run>=8) {
-                                    run &= 7;
-                                    RPK_READ(&tempbyte,1,1,infile);
-                                    run = (run<<8)|tempbyte;
-                                    run += 8;
-                                }
-                                RPK_READ(&tempbyte,1,1,infile);
-                                run = (run<<8)|tempbyte;
-                                run += 16;
-                            }
-                        }
-                        run++;
-                    }
-                    runcont:run--;
-                    switch (runtype) {
-                        case 1:
-                            RPK_READ(&tempbyte,1,1,infile);
-                            current.red ^= LRS(tempbyte,6)&3;
-                            current.green ^= LRS(tempbyte,4)&3;
-                            current.blue ^= LRS(tempbyte,2)&3;
-                            if (channels>3) current.alpha ^= tempbyte&3;
-                            break;
-                        case 2:
-                            RPK_READ(&temp,1,2,infile);
-                            current.red ^= LRS(temp.red,3)&0x1F;
-                            current.green ^= (temp.red&7)<<3|LRS(temp.green,5);
-                            current.blue ^= temp.green&0x1F;
-                            break;
-                        case 3:
-                            RPK_READ(&current,1,channels,infile);
-                    }
-                    cache[HASH(current)]=current;
-            }
-            memcpy(row+i,&current,channels);
-            *outlen += channels;
-        }
-    
-        ret = spng_encode_row(ctx,row,channels*width);
-        //rows_read++;
-    } while (!ret);
-    //If we make it here, we're missing an end of bytestream code,
-    //so there is probably something wrong with the file.
-    return !(ret==SPNG_EOI);
-}
-
-
-size_t rpk_write(const char *infile, const char *outfile) {
-    FILE *inf;
-	FILE *outf;
-	size_t size, width;
-    size_t byte_len;
-    size_t limit = 1024 * 1024 * 64;
-	char *encoded = NULL;
-    uint32_t temp;
-    int fmt = SPNG_FMT_RGBA8;
-    rpk_desc desc;
-    spng_ctx *ctx;
-    
-    inf = fopen(infile,"rb");
-    outf = fopen(outfile,"wb");
-    if (!inf||!outf) {
-		goto error;
-	}
-
-    ctx = spng_ctx_new(0);
-
-    if (!ctx) {
-        goto error;
-    }
-
-    // Ignore and don't calculate chunk CRC's
-    spng_set_crc_action(ctx, SPNG_CRC_USE, SPNG_CRC_USE);    
-
-    /* Set memory usage limits for storing standard and unknown chunks,
-       this is important when reading untrusted files! */
-    spng_set_chunk_limits(ctx, limit, limit);
-
-    // Set source PNG
-    spng_set_png_file(ctx, inf);
-
-    struct spng_ihdr ihdr;
-
-    if (spng_get_ihdr(ctx, &ihdr)||spng_decoded_image_size(ctx, fmt, &byte_len)||
-        spng_decode_image(ctx, NULL, 0, fmt, SPNG_DECODE_PROGRESSIVE)) {
-        goto error;
-    }
-    
-    
-    width = byte_len / (4*ihdr.height);
-    
-    //Construct description
-    desc.width = width;
-    desc.height = ihdr.height;
-    desc.channels = 3+(ihdr.color_type>>2&1);
-    //since we're just converting from png, probably safe to assume sRBG colorspace
-    desc.colorspace = RPK_SRBG;
-    
-    
-    
-    //Write file header
-    fprintf(outf,"rpk");
-    temp = htonl(desc.width);
-    fwrite(&temp, 1, 4, outf);
-    temp = htonl(desc.height);
-    fwrite(&temp, 1, 4, outf);
-    fprintf(outf,"%c%c", desc.channels, desc.colorspace);
-
-
-	if (rpk_encode(ctx, width, outf, &size, desc.channels)) {
-		goto error;
-	}
-    
-
-    //I have no idea what the file footer is for.
-    //Only print 7 bytes because we printed 1 coming out of rpk_encode
-    fwrite("\0\0\0\0\0\0\1",1,7,outf);
-    fclose(outf);
-
-    fclose(inf);
-    
-    spng_ctx_free(ctx);
-	
-	return size;
-    error:
-        fclose(inf);
-        fclose(outf);
-        spng_ctx_free(ctx);
-        return -1;
-}
-
-
-size_t rpk_read(const char *infile, const char *outfile) {
-	FILE *inf = fopen(infile, "rb");
-    FILE *outf = fopen(outfile, "wb");
-	size_t size;
-    long bytes_read, px_len;
-    char magic[3];
-    rpk_desc desc;
-    struct spng_ihdr ihdr = {0};
-    spng_ctx *enc;
-    int fmt;
-
-    if (!inf || !outf) {
-        goto error;
-    }
-
-    enc = spng_ctx_new(SPNG_CTX_ENCODER);
-
-    if (!enc) {
-        goto error;
-    }
-
-
-	//Check magic string
-    if (fread(magic,1,3,inf)!=3||memcmp(magic,"rpk",3)) {
-        goto error;
-    }
-    
-    //Extract desc from header
-    if (fread(&desc, 1, 10, inf)!=10) {
-        goto error;
-    }
-    
-
-    //Fix byte order on dimensions
-    desc.width = ntohl(desc.width);
-    desc.height = ntohl(desc.height);
-
-    //Create PNG header
-    ihdr.width = desc.width;
-    ihdr.height = desc.height;
-    ihdr.bit_depth = 8;
-    ihdr.color_type = 4*desc.channels-10;
-    
-    if (spng_set_ihdr(enc,&ihdr)) {
-        goto error;
-    }
-    
-    //Set file for context
-    spng_set_png_file(enc,outf);
-    
-    //Encoding format
-    fmt = SPNG_FMT_PNG;
-    
-    
-	if (spng_encode_image(enc, 0, 0, fmt, SPNG_ENCODE_PROGRESSIVE)||rpk_decode(inf, desc.width, enc, &size, desc.channels)) {
-        goto error;
-    }
-    
-    fclose(inf);
-    fclose(outf);
-    spng_ctx_free(enc);
-	return size;
-
-    error:
-        fclose(inf);
-        fclose(outf);
-        spng_ctx_free(enc);
-        return -1;
-}
+/* Rapid Picture Kompressor
+ * Fast, lossless image comprehension inspired by work on QOI/QOIG.
+ * The goal here is to be faster and simpler than QOI while still
+ * doing "okay" at compressing.
+ * 
+ * The header is identical to that of QOI/QOIG, with the sole change
+ * that the magic string is "RPK" instead of "QOIF".
+ * 
+ * The footer is also identical to that of QOI. (7 0 bytes and a 1 byte)
+ * 
+ * However, the compression algorithm is entirely different. On the highest
+ * level there are only two kinds of operations: INDEX and RUN. The MSB of
+ * the op byte encodes which of these two ops is being used.
+ * 
+ * 1. INDEX
+ * 
+ * ┌─ OP_INDEX ─────────────┐
+ * │         Byte[0]        │
+ * │ 7  6  5  4  3  2  1  0 │
+ * │───┼────────────────────│
+ * │ 0 │        index       │
+ * └───┴────────────────────┘
+ * 
+ * There is a 128-color cache. If the op byte is less than 128, it is used
+ * as an index into this cache and the color in that slot is inserted directly
+ * into the output.
+ * 
+ * Every pixel encoded/decoded has its color inserted into the cache at the
+ * position given by the hash function:
+ *       ((((88 ^ red)*13 ^ green)*13 ^ blue)*13 ^ alpha) & 127
+ * (This is essentially FNV-1a adapted to have decent dispersion over the range
+ * 0-127.)
+ * 
+ * 2. RUN
+ * 
+ * ┌─ OP_RUN ───────────────┐
+ * │         Byte[0]        │
+ * │ 7  6  5  4  3  2  1  0 │
+ * │───┼─────┼──────────────│
+ * │ 1 │ type│   length     │
+ * └───┴─────┴──────────────┘
+ * 
+ * One could think of RUN as being four different operations, but they all start
+ * with the same structure as above. They all indicate that a modification of the
+ * previous color should be inserted some number of times in a row. The "type" 
+ * argument can be thought of as "how many bytes to read per color." But we'll
+ * look at the four types separately and individually here:
+ * 
+ * ┌─ OP_RUN_TYPE_0 ────────┬────────────────────────┬────────────────────────┐
+ * │         Byte[0]        │     Byte[1] (maybe)    │     Byte[2] (maybe)    │
+ * │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │
+ * │─────────┼──────────────┼────────────────────────┼────────────────────────│
+ * │ 1  0  0 │                             length                             │
+ * └─────────┴──────────────┴────────────────────────┴────────────────────────┘
+ * 
+ * Run type 0 encodes a run of identical pixels, using up to 2 additional bytes
+ * to encode the length of the run. To be precise, here's how the allowed lengths
+ * are encoded:
+ * 
+ *               Length range          Code range         Total bytes
+ * ───────────────────────────┼───────────────────┼──────────────────
+ *                    1 to 16 │         0x80-0x8F │                 1
+ *             17 to 2**11+16 │     0x9000-0x97FF │                 2
+ * 2**11+17 to 2**19+2**11+16 │ 0x980000-0x9FFFFF │                 3
+ * 
+ * Bits 3 and 4 of the first byte signal whether additional bytes should be read.
+ * 
+ * Run types 1, 2, and 3 do not use any additional bytes to encode a longer run length.
+ * They use only the length indicated by the op byte with a bias of 1 to indicate
+ * a run of length 1 to 32.
+ * 
+ * Run type 1 will read an additional (length) bytes, each encoding an operation to
+ * be applied to the previous color to compute the next. These bytes are parsed thusly:
+ * 
+ * ┌─ OP_RUN_TYPE_1_ARG ────┐
+ * │         Byte[0]        │
+ * │ 7  6  5  4  3  2  1  0 │
+ * │──────┼─────┼─────┼─────│
+ * │  dr  │ dg  │ db  │ da  │
+ * └──────┴─────┴─────┴─────┘
+ * 
+ * The new color is computed by xoring each pair of bits with the least significant
+ * two bits of the corresponding component. E.g. newred = oldred ^ dr
+ * 
+ * For a 3-channel image, the da bits should always be zeroed.
+ * 
+ * Run type 2 will similarly read an additional (2*length) bytes, 2 bytes per new color.
+ * 
+ * ┌─ OP_RUN_TYPE_2_ARG ────┬────────────────────────┐
+ * │         Byte[0]        │         Byte[1]        │
+ * │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │
+ * │───────────────┼────────┼─────────┼──────────────│
+ * │       dr      │        dg        │      db      │
+ * └───────────────┴──────────────────┴──────────────┘
+ * 
+ * The new color is computed by xoring each group of bits with the least significant
+ * corresponding bits of the corresponding component, exactly as per run type 1.
+ * 
+ * Run type 3 will similarly read an additional (channels*length) bytes, (channels) per new color.
+ * 
+ * ┌─ OP_RUN_TYPE_3_ARG ────┬────────────────────────┬────────────────────────┬────────────────────────┐
+ * │         Byte[0]        │         Byte[1]        │         Byte[2]        │Byte[3] (iff channels=4)│
+ * │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │ 7  6  5  4  3  2  1  0 │
+ * │────────────────────────┼────────────────────────┼────────────────────────┼────────────────────────│
+ * │          red           │         green          │          blue          │         alpha          │
+ * └────────────────────────┴────────────────────────┴────────────────────────┴────────────────────────┘
+ * 
+ * To save an operation when computing the next color, the color encoded by these bytes is precisely the
+ * next color.
+ * 
+ * For a 3-channel image, the fourth byte *should be omitted entirely*.
+ * 
+ * Compression proceeds exactly one would expect: If the next color matches the previous, a run type 0 is set up.
+ * Otherwise, if the next color is in the cache, an INDEX op is output. If not, the next and previous colors are
+ * xored. If the result has only the least significant bits set, runs of type 1 or 2 is set up. Otherwise, a run 
+ * of type 3 is set up. If a run has already been set up and the result of the comparison indicates the same
+ * type of run again, the length of the run is extended and any arguments it will need are added to the buffer. If
+ * the run type changes or an index becomes possible, the RUN op is output followed by all the buffered arguments.
+ * 
+ * There are two small exceptions to this scheme: Runs of type 1 will NOT be interrupted to output an INDEX. Likewise,
+ * type two runs are NOT interrupted to begin a type 1 run. (Type 1 runs tend to be very short, so this is more likely
+ * to cost an extra byte than not.)
+ * 
+ * STRIPES
+ * 
+ * Setting bit 7 (RPK_STRIPED) of the colorspace byte splits the image into horizontal stripes that are coded
+ * independently of each other. A 4 byte big-endian stripe height S follows the header, and the image is coded as
+ * ceil(height/S) stripes of S rows (the last one may be shorter). Each stripe starts out like a whole image does,
+ * with an empty cache and a previous color of 0,0,0,255, and no run carries over into the next stripe. Stripes
+ * follow each other directly, so a striped file still decodes front to back. After the last stripe comes the
+ * stripe table: the file offset of every stripe and the offset just past the last one, each 8 bytes big-endian.
+ * The 8 byte footer then holds the file offset of the stripe table, big-endian, instead of 7 0 bytes and a 1.
+ * Since no stripe depends on another, striped files of consecutive row ranges of one image join into one file by
+ * copying their stripes and writing a new height and stripe table (rpk_concat), as long as they agree on width,
+ * channels and S and all but the last hold a whole number of stripes.
+ * 
+ * TILES
+ * 
+ * Setting bit 6 (RPK_TILED) of the colorspace byte instead splits the image into tiles of TW x TH pixels, given as
+ * two 4 byte big-endian numbers after the header. Tiles at the right and bottom edges are cut short by the image.
+ * Each tile is coded like an image of its own size, from an empty cache and a previous color of 0,0,0,255, and
+ * ends like a stripe does. Tiles are stored a row of tiles at a time, left to right, and are followed by the tile
+ * directory, which is laid out like the stripe table with an offset for every tile, and the footer pointing to it.
+ * A tiled file does not decode front to back as one stream: a decoder works through one row of tiles at a time,
+ * or reads just the tiles it needs. The two bits can't both be set.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+//Uses libspng with miniz
+#define SPNG_STATIC
+#define SPNG_USE_MINIZ
+#include "spng.h"
+#include "miniz.h"
+
+#define RPK_SRBG 0
+//Colorspace bit of striped files, see STRIPES above
+#define RPK_STRIPED 0x80
+//Colorspace bit of tiled files, see TILES above
+#define RPK_TILED 0x40
+#define RPK_HEADER_SIZE 13
+//Header plus stripe height
+#define RPK_STRIPED_HEADER_SIZE (RPK_HEADER_SIZE+4)
+//Header plus tile width and height
+#define RPK_TILED_HEADER_SIZE (RPK_HEADER_SIZE+8)
+//Bytes rpk_emit may store: a run header, the 128 byte argument buffer and an index
+#define RPK_MAX_PRINT 130
+/* Memory use. No buffer lives on the stack (the codec state there is about 1 KiB)
+ * and nothing scales with the image height, so many conversions can run at once
+ * on default thread stacks. With W the width in pixels and C the channels,
+ * a single conversion holds at most:
+ *   rpk_write_ex          W*C + RPK_OUTBUF_SIZE, plus libspng's decoder
+ *     RPK_DETECT_OPAQUE   + 4*W during the pre-scan
+ *     RPK_THREADED        + RPK_RING_ROWS*W*C
+ *     RPK_PARALLEL_ENCODE + 2*threads blocks of MAX(RPK_ENCODE_BLOCK,W) pixels,
+ *                         (C+2) bytes each (2 bytes with rpk_encode_pixels_ex)
+ *   rpk_read_ex           W*C + RPK_INBUF_SIZE, plus libspng's encoder
+ *     RPK_MMAP            - RPK_INBUF_SIZE (the file is mapped, not copied)
+ *     RPK_THREADED        + RPK_RING_ROWS*W*C
+ *     RPK_PARALLEL_DEFLATE  instead of libspng, 2*threads blocks of at most
+ *                         3*MAX(RPK_DEFLATE_BLOCK,W*C)+3*W*C each, plus one
+ *                         miniz compressor per worker
+ *   rpk_encode_pixels     the output, grown by doubling
+ *   rpk_decode_pixels     nothing beyond the caller's buffers, for a single stream
+ * Striped files (stripe_rows S) trade that bound for parallelism:
+ *   rpk_write_ex          2*threads stripes of S*W*C raw rows plus their encoded bytes
+ *   rpk_encode_pixels_ex  2*threads encoded stripes, plus the output
+ *   rpk_read_ex           RPK_PARALLEL_DEFLATE with RPK_MMAP: blocks of whole stripes
+ *   rpk_decode_pixels_ex  on more than one thread: a checkpoint (about 540 bytes)
+ *                         and a job per stripe, plus the thread pool
+ * A sidecar index (checkpoints every K rows) does the same for a single stream:
+ *   rpk_read_ex           RPK_PARALLEL_DEFLATE (required), the file mapped: blocks of
+ *                         whole stretches of K rows, plus the index, one decoder
+ *                         state per checkpoint
+ *   rpk_decode_pixels_ex  the index, loaded whole (about 540 bytes per checkpoint),
+ *                         and a job per checkpoint, plus the thread pool
+ *   rpk_concat            16 bytes per stripe; the fragments are mapped, not copied
+ * Tiled files (tiles TW x TH, T of them in all) are coded a row of tiles at a time:
+ *   rpk_write_ex          one coded row of tiles, plus 8*T bytes of tile directory
+ *   rpk_read_ex           the file is always mapped; 8*T bytes of tile directory,
+ *                         plus a decoder state per tile column
+ *   rpk_decode_pixels     8*T bytes of tile directory, with or without threads
+ *   rpk_decode_tile       nothing beyond the caller's buffers
+ * All row buffers are RPK_ALIGN aligned heap blocks from rpk_alloc. */
+#define RPK_ALIGN 64
+#ifndef RPK_OUTBUF_SIZE
+#define RPK_OUTBUF_SIZE (256*1024)
+#endif
+#ifndef RPK_INBUF_SIZE
+#define RPK_INBUF_SIZE (256*1024)
+#endif
+//Row buffers in flight between the two threads of a pipelined conversion
+#ifndef RPK_RING_ROWS
+#define RPK_RING_ROWS 16
+#endif
+//Uncompressed bytes per deflate job when compressing PNG output in parallel
+#ifndef RPK_DEFLATE_BLOCK
+#define RPK_DEFLATE_BLOCK (256*1024)
+#endif
+//Pixels per job when classifying rows for RPK_PARALLEL_ENCODE
+#ifndef RPK_ENCODE_BLOCK
+#define RPK_ENCODE_BLOCK (64*1024)
+#endif
+#define LRS(a,b) ((unsigned)(a)>>(b))
+#define RPK_NEED(n) if ((size_t)(end-p)<(n)) {\
+                        in->p = p;\
+                        if (rpk_refill(in,n)) return -1;\
+                        p = in->p;\
+                        end = in->end;\
+                    }
+#define HASH(C) (((((88^C.red)*13^C.green)*13^C.blue)*13^C.alpha)&127)
+#define EQCOLOR(a,b) (a.rgba == b.rgba)
+//Longest type 0 run a single op can hold
+#define RPK_MAX_RUN 526352
+//Pixels the encoder classifies per pass, and the class bits it assigns
+#define RPK_CLASS_BLOCK 256
+#define RPK_CLS_NO1 1 //diff too wide for a type 1 run
+#define RPK_CLS_NO2 2 //diff too wide for a type 2 run
+#define RPK_CLS_NE 4  //pixel differs from the one before it
+#define MIN(a,b) ((a)>(b)?(b):(a))
+#define MAX(a,b) ((a)<(b)?(b):(a))
+//For bodies that are instantiated once per channel count with a constant argument
+#define RPK_INLINE static inline __attribute__((always_inline))
+//Kernel sets chosen at run time by rpk_simd
+#define RPK_SIMD_SCALAR 0
+#define RPK_SIMD_SSE2 1
+#define RPK_SIMD_AVX2 2
+#if defined(__SSE2__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RPK_HAVE_AVX2
+#define RPK_AVX2 __attribute__((target("avx2")))
+#endif
+
+typedef union {
+    uint32_t rgba;
+    struct {
+        unsigned char red;
+        unsigned char green;
+        unsigned char blue;
+        unsigned char alpha;
+    };
+} color;
+
+typedef struct {
+	uint32_t width;
+	uint32_t height;
+	uint8_t channels;
+	uint8_t colorspace;
+	uint32_t stripe_rows;	//rows per stripe if colorspace has RPK_STRIPED, else 0
+	uint32_t tile_width;	//tile size if colorspace has RPK_TILED, else 0
+	uint32_t tile_height;
+} rpk_desc;
+
+/* Byte sink for the encoder. Bytes are staged in buf. With file set, buf is
+ * a fixed RPK_OUTBUF_SIZE block that is written out whenever it fills up,
+ * otherwise it grows to hold the whole output. flushed+pos counts every byte
+ * written either way. After an error, output is discarded and err is set. */
+typedef struct {
+    uint8_t *buf;
+    size_t pos;
+    size_t cap;
+    size_t flushed;
+    FILE *file;
+    int err;
+} rpk_writer;
+
+/* Byte source for the decoder. The decoder consumes the memory range [p,end).
+ * With file set, that range is a window into buf that is refilled from the
+ * file in RPK_INBUF_SIZE blocks once the decoder runs out of bytes.
+ * With mapped set, buf is a read-only mapping of the whole file (cap bytes). */
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    FILE *file;
+    uint8_t *buf;
+    size_t cap;
+    int mapped;
+} rpk_reader;
+
+//Options for rpk_write_ex and rpk_read_ex. Passing NULL selects the defaults.
+typedef struct {
+    unsigned flags;
+    unsigned threads;   //worker threads for parallel modes, 0 for one per online CPU
+    uint32_t stripe_rows; //writing: stripes of this many rows coded in parallel, 0 for a single stream
+    const char *index;  //reading: sidecar index (.rpki) to decode a single-stream file in parallel from, with RPK_PARALLEL_DEFLATE only
+    uint32_t tile_width;  //writing: tiles of this size coded independently, 0 for none
+    uint32_t tile_height;
+} rpk_opts;
+
+//rpk_read_ex: mmap the input and decode straight from the mapping
+#define RPK_MMAP 1
+//rpk_write_ex: store PNGs with alpha as 3 channels if every pixel is opaque
+#define RPK_DETECT_OPAQUE 2
+//rpk_write_ex/rpk_read_ex: run PNG coding and RPK coding on separate threads
+#define RPK_THREADED 4
+//rpk_read_ex: write the PNG without libspng, deflating blocks of rows on a thread pool
+#define RPK_PARALLEL_DEFLATE 8
+/* Writing a single stream: classify and hash blocks of rows on a thread pool.
+ * The ops are still chosen in order, so the output is the same byte for byte.
+ * Takes precedence over RPK_THREADED. */
+#define RPK_PARALLEL_ENCODE 16
+
+//Encoder state carried from one row to the next
+typedef struct {
+    color cache[128];
+    color current;
+    uint32_t run;
+    uint8_t runtype;
+    uint8_t channels;
+    uint8_t simd;
+    uint8_t buffer[128];
+    rpk_writer *out;
+} rpk_encoder;
+
+//Decoder state carried from one row to the next
+typedef struct {
+    color cache[128];
+    color current;
+    uint32_t run;
+    uint8_t runtype;
+    uint8_t channels;
+    uint8_t simd;
+    uint32_t stripe_rows;   //start over every this many rows, 0 for a single stream
+    uint32_t rows;          //rows decoded in the current stripe
+} rpk_decoder;
+
+/* Decoder state at the start of a row, from which decoding can pick up
+ * without going through the rows before it: the start of a stripe, or a
+ * checkpoint from a sidecar index (see rpk_index_write). */
+typedef struct {
+    uint64_t offset;    //file offset of the first byte not decoded yet
+    uint32_t row;
+    rpk_decoder dec;
+} rpk_checkpoint;
+
+
+static void *rpk_alloc(size_t size) {
+    void *p;
+    return posix_memalign(&p,RPK_ALIGN,size ? size : 1) ? NULL : p;
+}
+
+static int rpk_writer_init(rpk_writer *w, FILE *file) {
+    memset(w,0,sizeof(*w));
+    w->file = file;
+    w->cap = RPK_OUTBUF_SIZE;
+    w->buf = rpk_alloc(w->cap);
+    return w->buf ? 0 : -1;
+}
+
+static void rpk_flush(rpk_writer *w) {
+    if (w->file && w->pos) {
+        if (!w->err && fwrite(w->buf,1,w->pos,w->file)!=w->pos) w->err = 1;
+        w->flushed += w->pos;
+        w->pos = 0;
+    }
+}
+
+//Slow path of rpk_reserve: make room by flushing to file or by growing buf
+static uint8_t *rpk_reserve_slow(rpk_writer *w, size_t n) {
+    uint8_t *buf;
+    size_t cap = w->cap;
+    if (w->file) {
+        rpk_flush(w);
+        return w->buf;
+    }
+    while (cap < w->pos+n) cap *= 2;
+    if (w->err || !(buf = realloc(w->buf,cap))) {
+        //Keep going in the space we have, which is still RPK_OUTBUF_SIZE or more; the output is lost anyway
+        w->err = 1;
+        w->flushed += w->pos;
+        w->pos = 0;
+        return w->buf;
+    }
+    w->buf = buf;
+    w->cap = cap;
+    return w->buf+w->pos;
+}
+
+//Return room for n (<= RPK_OUTBUF_SIZE) bytes at buf+pos. The caller advances pos.
+static inline uint8_t *rpk_reserve(rpk_writer *w, size_t n) {
+    if (w->pos+n <= w->cap) return w->buf+w->pos;
+    return rpk_reserve_slow(w,n);
+}
+
+static void rpk_put(rpk_writer *w, const void *data, size_t n) {
+    memcpy(rpk_reserve(w,n),data,n);
+    w->pos += n;
+}
+
+static int rpk_reader_init(rpk_reader *rd, FILE *file) {
+    memset(rd,0,sizeof(*rd));
+    rd->file = file;
+    //Literal runs are read whole, so the longest op must fit
+    rd->cap = MAX(RPK_INBUF_SIZE,RPK_MAX_PRINT);
+    rd->buf = rpk_alloc(rd->cap);
+    rd->p = rd->end = rd->buf;
+    return rd->buf ? 0 : -1;
+}
+
+/* Map the whole file at path for reading, so the decoder runs directly over
+ * the page cache without copying through stdio. */
+static int rpk_reader_map(rpk_reader *rd, const char *path) {
+    struct stat st;
+    void *map;
+    int fd = open(path,O_RDONLY);
+    memset(rd,0,sizeof(*rd));
+    if (fd<0) return -1;
+    if (fstat(fd,&st)||st.st_size<=0) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if (map==MAP_FAILED) return -1;
+    madvise(map,st.st_size,MADV_SEQUENTIAL);
+    rd->buf = map;
+    rd->cap = st.st_size;
+    rd->mapped = 1;
+    rd->p = rd->buf;
+    rd->end = rd->buf+rd->cap;
+    return 0;
+}
+
+static void rpk_reader_free(rpk_reader *rd) {
+    if (rd->mapped) {
+        munmap(rd->buf,rd->cap);
+    } else {
+        free(rd->buf);
+    }
+    rd->buf = NULL;
+}
+
+//Make at least n bytes available at p. Returns nonzero if the input runs out first.
+static int rpk_refill(rpk_reader *rd, size_t n) {
+    size_t left = rd->end-rd->p;
+    if (!rd->file) return left<n;
+    memmove(rd->buf,rd->p,left);
+    left += fread(rd->buf+left,1,rd->cap-left,rd->file);
+    rd->p = rd->buf;
+    rd->end = rd->buf+left;
+    return left<n;
+}
+
+static int rpk_get(rpk_reader *rd, void *dst, size_t n) {
+    if ((size_t)(rd->end-rd->p)<n && rpk_refill(rd,n)) return 1;
+    memcpy(dst,rd->p,n);
+    rd->p += n;
+    return 0;
+}
+
+static void rpk_write_header(rpk_writer *out, const rpk_desc *desc) {
+    uint8_t hdr[RPK_HEADER_SIZE] = {'r','p','k'};
+    uint32_t temp;
+    temp = htonl(desc->width);
+    memcpy(hdr+3,&temp,4);
+    temp = htonl(desc->height);
+    memcpy(hdr+7,&temp,4);
+    hdr[11] = desc->channels;
+    hdr[12] = desc->colorspace;
+    rpk_put(out,hdr,RPK_HEADER_SIZE);
+    if (desc->colorspace&RPK_STRIPED) {
+        temp = htonl(desc->stripe_rows);
+        rpk_put(out,&temp,4);
+    }
+    if (desc->colorspace&RPK_TILED) {
+        temp = htonl(desc->tile_width);
+        rpk_put(out,&temp,4);
+        temp = htonl(desc->tile_height);
+        rpk_put(out,&temp,4);
+    }
+}
+
+//I have no idea what the file footer is for.
+//Only print 7 bytes because we printed 1 coming out of rpk_encode_finish
+static void rpk_write_footer(rpk_writer *out) {
+    rpk_put(out,"\0\0\0\0\0\0\1",7);
+}
+
+static int rpk_read_header(rpk_reader *in, rpk_desc *desc) {
+    uint8_t hdr[RPK_HEADER_SIZE];
+    uint32_t temp;
+    //Check magic string
+    if (rpk_get(in,hdr,RPK_HEADER_SIZE)||memcmp(hdr,"rpk",3)) return -1;
+    //Fix byte order on dimensions
+    memcpy(&temp,hdr+3,4);
+    desc->width = ntohl(temp);
+    memcpy(&temp,hdr+7,4);
+    desc->height = ntohl(temp);
+    desc->channels = hdr[11];
+    desc->colorspace = hdr[12];
+    desc->stripe_rows = 0;
+    desc->tile_width = desc->tile_height = 0;
+    if (desc->channels!=3&&desc->channels!=4) return -1;
+    if ((desc->colorspace&(RPK_STRIPED|RPK_TILED))==(RPK_STRIPED|RPK_TILED)) return -1;
+    if (desc->colorspace&RPK_STRIPED) {
+        if (rpk_get(in,&temp,4)) return -1;
+        desc->stripe_rows = ntohl(temp);
+        if (!desc->stripe_rows) return -1;
+    }
+    if (desc->colorspace&RPK_TILED) {
+        if (rpk_get(in,&temp,4)) return -1;
+        desc->tile_width = ntohl(temp);
+        if (rpk_get(in,&temp,4)) return -1;
+        desc->tile_height = ntohl(temp);
+        if (!desc->tile_width||!desc->tile_height) return -1;
+    }
+    return 0;
+}
+
+
+/* Best RPK_SIMD_* level this CPU runs, probed once. The RPK_SIMD environment
+ * variable ("scalar", "sse2" or "avx2") caps it, for testing the fallbacks. */
+static int rpk_simd(void) {
+    static atomic_int level = -1;
+    const char *env;
+    int l = atomic_load_explicit(&level,memory_order_relaxed);
+    if (l>=0) return l;
+    l = RPK_SIMD_SCALAR;
+#if defined(__SSE2__)
+    l = RPK_SIMD_SSE2;
+#endif
+#if defined(RPK_HAVE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) l = RPK_SIMD_AVX2;
+#endif
+    if ((env = getenv("RPK_SIMD"))) {
+        if (!strcmp(env,"scalar")) l = RPK_SIMD_SCALAR;
+        else if (!strcmp(env,"sse2")) l = MIN(l,RPK_SIMD_SSE2);
+    }
+    atomic_store_explicit(&level,l,memory_order_relaxed);
+    return l;
+}
+
+void rpk_encoder_init(rpk_encoder *enc, rpk_writer *out, uint8_t channels) {
+    memset(enc->cache,0,sizeof(enc->cache));
+    enc->current = (color){.alpha=255};
+    enc->run = 0;
+    enc->runtype = -1;
+    enc->channels = channels;
+    enc->simd = rpk_simd();
+    enc->out = out;
+}
+
+/* Finish rpk_run_length from pixel i on: SSE2 steps of 16 pixels, then single
+ * pixels from the first block with a mismatch in it. */
+RPK_INLINE size_t rpk_run_tail(const uint8_t *px, size_t i, size_t n, const uint8_t channels, const int simd) {
+    const uint8_t *q;
+#if defined(__SSE2__)
+    unsigned j, m;
+    if (simd>=RPK_SIMD_SSE2) {
+        for (;i+16<=n;i+=16) {
+            for (j=0;j<channels;j++) {
+                q = px+i*channels+16*j;
+                m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)q),
+                                                     _mm_loadu_si128((const __m128i *)(q-channels))));
+                if (m!=0xFFFF) return i+(16*j+__builtin_ctz(~m))/channels;
+            }
+        }
+    }
+#endif
+    for (;i<n;i++) {
+        q = px+i*channels;
+        if (memcmp(q,q-channels,channels)) break;
+    }
+    return i;
+}
+
+#if defined(RPK_HAVE_AVX2)
+//rpk_run_length in steps of 32 pixels
+RPK_AVX2 static size_t rpk_run_length_avx2(const uint8_t *px, size_t n, uint8_t channels) {
+    const uint8_t *q;
+    size_t i;
+    unsigned j, m;
+    for (i=0;i+32<=n;i+=32) {
+        for (j=0;j<channels;j++) {
+            q = px+i*channels+32*j;
+            m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)q),
+                                                       _mm256_loadu_si256((const __m256i *)(q-channels))));
+            if (m!=0xFFFFFFFF) return i+(32*j+__builtin_ctz(~m))/channels;
+        }
+    }
+    return rpk_run_tail(px,i,n,channels,RPK_SIMD_AVX2);
+}
+#endif
+
+/* Count how many of the n pixels at px repeat the pixel just before px. Runs
+ * of flat color are checked 32 (AVX2) or 16 (SSE2) pixels at a time by
+ * comparing every byte with the byte one pixel back. */
+RPK_INLINE size_t rpk_run_length(const uint8_t *px, size_t n, const uint8_t channels, const int simd) {
+    //Most runs in busy images end at once; don't pay for the vector setup
+    if (!n || memcmp(px,px-channels,channels)) return 0;
+#if defined(RPK_HAVE_AVX2)
+    if (simd>=RPK_SIMD_AVX2) return rpk_run_length_avx2(px,n,channels);
+#endif
+    return rpk_run_tail(px,0,n,channels,simd);
+}
+
+/* Count how many of the n class bytes at cls are 0, i.e. how many pixels in a
+ * row repeat the one before them. This is rpk_run_length for pixels that are
+ * already classified, at a quarter of the bytes to compare. */
+RPK_INLINE size_t rpk_zero_run(const uint8_t *cls, size_t n, const int simd) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    unsigned m;
+#endif
+    if (!n || cls[0]) return 0;
+#if defined(__SSE2__)
+    if (simd>=RPK_SIMD_SSE2) {
+        for (;i+16<=n;i+=16) {
+            m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(cls+i)),_mm_setzero_si128()));
+            if (m!=0xFFFF) return i+__builtin_ctz(~m);
+        }
+    }
+#endif
+    while (i<n && !cls[i]) i++;
+    return i;
+}
+
+//Bytes of type2mask laid out over 16 pixels of 3 or 4 channels
+static const uint8_t rpk_type2bytes[2][64] = {
+    {0xE0,0xC0,0xE0,0xE0,0xC0,0xE0,0xE0,0xC0,0xE0,0xE0,0xC0,0xE0,0xE0,0xC0,0xE0,0xE0,
+     0xC0,0xE0,0xE0,0xC0,0xE0,0xE0,0xC0,0xE0,0xE0,0xC0,0xE0,0xE0,0xC0,0xE0,0xE0,0xC0,
+     0xE0,0xE0,0xC0,0xE0,0xE0,0xC0,0xE0,0xE0,0xC0,0xE0,0xE0,0xC0,0xE0,0xE0,0xC0,0xE0},
+    {0xE0,0xC0,0xE0,0xFF,0xE0,0xC0,0xE0,0xFF,0xE0,0xC0,0xE0,0xFF,0xE0,0xC0,0xE0,0xFF,
+     0xE0,0xC0,0xE0,0xFF,0xE0,0xC0,0xE0,0xFF,0xE0,0xC0,0xE0,0xFF,0xE0,0xC0,0xE0,0xFF,
+     0xE0,0xC0,0xE0,0xFF,0xE0,0xC0,0xE0,0xFF,0xE0,0xC0,0xE0,0xFF,0xE0,0xC0,0xE0,0xFF,
+     0xE0,0xC0,0xE0,0xFF,0xE0,0xC0,0xE0,0xFF,0xE0,0xC0,0xE0,0xFF,0xE0,0xC0,0xE0,0xFF}
+};
+
+#if defined(RPK_HAVE_AVX2)
+//The 4 channel lane path of rpk_classify in steps of 32 pixels, from pixel i on
+RPK_AVX2 static size_t rpk_classify4_avx2(const uint8_t *px, size_t i, size_t n, uint8_t *cls) {
+    const __m256i zero = _mm256_setzero_si256(), fc = _mm256_set1_epi8((char)0xFC);
+    const __m256i t2 = _mm256_loadu_si256((const __m256i *)rpk_type2bytes[1]);
+    const __m256i ne = _mm256_set1_epi32(RPK_CLS_NE), no1 = _mm256_set1_epi32(RPK_CLS_NO1), no2 = _mm256_set1_epi32(RPK_CLS_NO2);
+    const uint8_t *q;
+    unsigned j;
+    __m256i d,b,c[4];
+    for (;i+32<=n;i+=32) {
+        for (j=0;j<4;j++) {
+            q = px+i*4+32*j;
+            d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)q),_mm256_loadu_si256((const __m256i *)(q-4)));
+            b = _mm256_andnot_si256(_mm256_cmpeq_epi32(d,zero),ne);
+            b = _mm256_or_si256(b,_mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(d,fc),zero),no1));
+            c[j] = _mm256_or_si256(b,_mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_and_si256(d,t2),zero),no2));
+        }
+        //The packs work within 128-bit halves; the permute puts the pixels back in order
+        b = _mm256_packus_epi16(_mm256_packs_epi32(c[0],c[1]),_mm256_packs_epi32(c[2],c[3]));
+        _mm256_storeu_si256((__m256i *)(cls+i),_mm256_permutevar8x32_epi32(b,_mm256_setr_epi32(0,4,1,5,2,6,3,7)));
+    }
+    return i;
+}
+#endif
+
+/* Write the RPK_CLS_* bits of each of the n pixels at px to cls, diffing the
+ * first one against last. This takes the width tests off the encoder's serial
+ * path: 16 pixels (32 for RGBA with AVX2) are xored with their predecessors
+ * and tested against 0xFC and type2mask at once, and only the per-pixel bits
+ * of RGB pixels are gathered one by one. */
+RPK_INLINE void rpk_classify(const uint8_t *px, size_t n, color last, uint8_t *cls, const uint8_t channels, const int simd) {
+    color current,diff;
+    color type2mask = (color){.red = 0xE0,.green = 0xC0,.blue = 0xE0,.alpha=0xFF};
+    size_t i = 0;
+#if defined(__SSE2__)
+    const uint8_t *t2 = rpk_type2bytes[channels-3];
+    const __m128i zero = _mm_setzero_si128(), fc = _mm_set1_epi8((char)0xFC);
+    const __m128i ne = _mm_set1_epi8(RPK_CLS_NE), no1 = _mm_set1_epi8(RPK_CLS_NO1), no2 = _mm_set1_epi8(RPK_CLS_NO2);
+    uint8_t bits[64] __attribute__((aligned(16)));
+    const uint8_t *q;
+    unsigned j,k,any;
+    __m128i d,b;
+    if (simd>=RPK_SIMD_SSE2 && n) {
+        //The first pixel's predecessor isn't in px
+        current = last;
+        memcpy(&current,px,channels);
+        diff.rgba = current.rgba^last.rgba;
+        cls[0] = (diff.rgba!=0)*RPK_CLS_NE|((diff.rgba&type2mask.rgba)!=0)*RPK_CLS_NO2|((diff.rgba&0xFCFCFCFC)!=0)*RPK_CLS_NO1;
+        i = 1;
+#if defined(RPK_HAVE_AVX2)
+        if (channels==4 && simd>=RPK_SIMD_AVX2) i = rpk_classify4_avx2(px,i,n,cls);
+#endif
+        //With 4 channels each 32-bit lane is a pixel, so the bits are packed straight out
+        for (;channels==4 && i+16<=n;i+=16) {
+            __m128i c[4];
+            for (j=0;j<4;j++) {
+                q = px+i*4+16*j;
+                d = _mm_xor_si128(_mm_loadu_si128((const __m128i *)q),_mm_loadu_si128((const __m128i *)(q-4)));
+                b = _mm_andnot_si128(_mm_cmpeq_epi32(d,zero),ne);
+                b = _mm_or_si128(b,_mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(d,fc),zero),no1));
+                b = _mm_or_si128(b,_mm_andnot_si128(_mm_cmpeq_epi32(_mm_and_si128(d,_mm_loadu_si128((const __m128i *)t2)),zero),no2));
+                //Keep the bits in the low byte only so the packs don't saturate
+                c[j] = _mm_and_si128(b,_mm_set1_epi32(0xFF));
+            }
+            _mm_storeu_si128((__m128i *)(cls+i),_mm_packus_epi16(_mm_packs_epi32(c[0],c[1]),_mm_packs_epi32(c[2],c[3])));
+        }
+        for (;i+16<=n;i+=16) {
+            //Class bits of every byte, then of every pixel as the OR of its bytes
+            any = 0;
+            for (j=0;j<channels;j++) {
+                q = px+i*channels+16*j;
+                d = _mm_xor_si128(_mm_loadu_si128((const __m128i *)q),_mm_loadu_si128((const __m128i *)(q-channels)));
+                b = _mm_andnot_si128(_mm_cmpeq_epi8(d,zero),ne);
+                b = _mm_or_si128(b,_mm_andnot_si128(_mm_cmpeq_epi8(_mm_and_si128(d,fc),zero),no1));
+                b = _mm_or_si128(b,_mm_andnot_si128(_mm_cmpeq_epi8(_mm_and_si128(d,_mm_loadu_si128((const __m128i *)(t2+16*j))),zero),no2));
+                _mm_store_si128((__m128i *)(bits+16*j),b);
+                any |= _mm_movemask_epi8(_mm_cmpeq_epi8(d,zero))^0xFFFF;
+            }
+            //Flat stretches are common enough to skip the gather for
+            if (!any) {
+                memset(cls+i,0,16);
+                continue;
+            }
+            for (k=0;k<16;k++) {
+                cls[i+k] = bits[k*channels]|bits[k*channels+1]|bits[k*channels+2]|(channels==4 ? bits[k*4+3] : 0);
+            }
+        }
+        memcpy(&last,px+(i-1)*channels,channels);
+    }
+#endif
+    for (;i<n;i++) {
+        current = last;
+        memcpy(&current,px+i*channels,channels);
+        diff.rgba = current.rgba^last.rgba;
+        cls[i] = (diff.rgba!=0)*RPK_CLS_NE|((diff.rgba&type2mask.rgba)!=0)*RPK_CLS_NO2|((diff.rgba&0xFCFCFCFC)!=0)*RPK_CLS_NO1;
+        last = current;
+    }
+}
+
+//HASH of the pixels in the 32-bit lanes of v, done as shifts and adds
+#define RPK_MUL13(x) _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(x,3),_mm_slli_epi32(x,2)),x)
+#define RPK_MUL13_256(x) _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(x,3),_mm256_slli_epi32(x,2)),x)
+
+#if defined(RPK_HAVE_AVX2)
+//rpk_hash_slots in steps of 32 pixels
+RPK_AVX2 static size_t rpk_hash_slots_avx2(const uint8_t *px, size_t n, uint8_t *slots, uint8_t channels) {
+    const __m256i ff = _mm256_set1_epi32(0xFF), seed = _mm256_set1_epi32(88);
+    __m256i v,h,c[4];
+    uint32_t u[8];
+    size_t i;
+    unsigned j,k;
+    for (i=0;i+32+(channels==3)<=n;i+=32) {
+        for (j=0;j<4;j++) {
+            if (channels==4) {
+                v = _mm256_loadu_si256((const __m256i *)(px+(i+8*j)*4));
+            } else {
+                for (k=0;k<8;k++) memcpy(&u[k],px+(i+8*j+k)*3,4);
+                v = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)u),_mm256_set1_epi32(0xFF000000));
+            }
+            h = _mm256_xor_si256(_mm256_and_si256(v,ff),seed);
+            h = _mm256_xor_si256(RPK_MUL13_256(h),_mm256_and_si256(_mm256_srli_epi32(v,8),ff));
+            h = _mm256_xor_si256(RPK_MUL13_256(h),_mm256_and_si256(_mm256_srli_epi32(v,16),ff));
+            h = _mm256_xor_si256(RPK_MUL13_256(h),_mm256_srli_epi32(v,24));
+            c[j] = _mm256_and_si256(h,_mm256_set1_epi32(127));
+        }
+        v = _mm256_packus_epi16(_mm256_packs_epi32(c[0],c[1]),_mm256_packs_epi32(c[2],c[3]));
+        _mm256_storeu_si256((__m256i *)(slots+i),_mm256_permutevar8x32_epi32(v,_mm256_setr_epi32(0,4,1,5,2,6,3,7)));
+    }
+    return i;
+}
+#endif
+
+/* Write the cache slot HASH gives each of the n pixels at px to slots. The
+ * hash only keeps 7 bits, so it can run in 32-bit lanes with *13 done as
+ * shifts and adds and still match HASH exactly. With SSE2 that is 16 pixels
+ * per step (32 with AVX2): RGBA pixels load straight into lanes, RGB pixels
+ * are picked up 4 bytes at a time and given alpha 255, which needs one pixel
+ * of slack. */
+RPK_INLINE void rpk_hash_slots(const uint8_t *px, size_t n, uint8_t *slots, const uint8_t channels, const int simd) {
+    color current = (color){.alpha=255};
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i ff = _mm_set1_epi32(0xFF), seed = _mm_set1_epi32(88);
+    __m128i v,h,c[4];
+    uint32_t u[4];
+    unsigned j,k;
+#if defined(RPK_HAVE_AVX2)
+    if (simd>=RPK_SIMD_AVX2 && n>=32) i = rpk_hash_slots_avx2(px,n,slots,channels);
+#endif
+    for (;simd>=RPK_SIMD_SSE2 && i+16+(channels==3)<=n;i+=16) {
+        for (j=0;j<4;j++) {
+            if (channels==4) {
+                v = _mm_loadu_si128((const __m128i *)(px+(i+4*j)*4));
+            } else {
+                for (k=0;k<4;k++) memcpy(&u[k],px+(i+4*j+k)*3,4);
+                v = _mm_or_si128(_mm_loadu_si128((const __m128i *)u),_mm_set1_epi32(0xFF000000));
+            }
+            h = _mm_xor_si128(_mm_and_si128(v,ff),seed);
+            h = _mm_xor_si128(RPK_MUL13(h),_mm_and_si128(_mm_srli_epi32(v,8),ff));
+            h = _mm_xor_si128(RPK_MUL13(h),_mm_and_si128(_mm_srli_epi32(v,16),ff));
+            h = _mm_xor_si128(RPK_MUL13(h),_mm_srli_epi32(v,24));
+            c[j] = _mm_and_si128(h,_mm_set1_epi32(127));
+        }
+        _mm_storeu_si128((__m128i *)(slots+i),_mm_packus_epi16(_mm_packs_epi32(c[0],c[1]),_mm_packs_epi32(c[2],c[3])));
+    }
+#endif
+    for (;i<n;i++) {
+        memcpy(&current,px+i*channels,channels);
+        slots[i] = HASH(current);
+    }
+}
+
+//Argument bytes per pixel of each run type, for 3 and 4 channels
+static const uint8_t rpk_argbytes[2][4] = {{0,1,2,3},{0,1,2,4}};
+//Op header of the 1, 2 and 3 byte type 0 run lengths: code base and length bias
+static const uint32_t rpk_run0_code[3] = {0x80,0x9000,0x980000};
+static const uint32_t rpk_run0_bias[3] = {1,17,2065};
+
+/* Write out the pending run of run pixels (run type runtype, arguments in
+ * buffer), then the index op b unless b is 128 or more. The header is built
+ * from the tables above and stored as one big-endian word of which its 1 to 3
+ * bytes are kept, the arguments are copied whole and the index byte is always
+ * stored, so the only branches left are on run and runtype. All of it fits in
+ * the RPK_MAX_PRINT bytes reserved. */
+RPK_INLINE void rpk_emit(rpk_writer *out, const uint8_t *buffer, uint32_t run, uint8_t runtype, uint8_t channels, unsigned b) {
+    uint8_t *o = rpk_reserve(out,RPK_MAX_PRINT);
+    uint32_t head;
+    unsigned k;
+    if (run) {
+        k = runtype ? 0 : (run>16)+(run>2064);
+        head = htonl((rpk_run0_code[k]+(runtype<<5)+run-rpk_run0_bias[k])<<(24-8*k));
+        memcpy(o,&head,4);
+        o += k+1;
+        //A fixed-size copy of the whole buffer is a few wide stores, not a call
+        if (runtype) memcpy(o,buffer,128);
+        o += rpk_argbytes[channels-3][runtype]*run;
+    }
+    *o = b;
+    o += b<128;
+    out->pos = o-out->buf;
+}
+
+/* Encoder loop over one row of packed RGB or RGBA pixels. channels is always
+ * a constant, so each instantiation loads and stores pixels with fixed sizes.
+ * The row is classified and hashed RPK_CLASS_BLOCK pixels at a time, unless
+ * pcls and pslots already hold the class bits and slots of all of it; then
+ * runs are found in those bits too and only the decisions that depend on the
+ * run and cache state are left here. */
+RPK_INLINE void rpk_encode_row_n(rpk_encoder *enc, const uint8_t *px, size_t width,
+                                 const uint8_t *pcls, const uint8_t *pslots, const uint8_t channels) {
+    color *cache = enc->cache;
+    uint8_t *buffer = enc->buffer;
+    rpk_writer *out = enc->out;
+    color last,diff;
+    color current = enc->current;
+    uint8_t runtype = enc->runtype;
+    uint32_t run = enc->run;
+    const int simd = enc->simd;
+    uint8_t op;
+    uint8_t cbuf[RPK_CLASS_BLOCK],sbuf[RPK_CLASS_BLOCK],h;
+    const uint8_t *cls = pcls, *slots = pslots;
+    size_t i,n,start = 0,end = pcls ? width : 0;
+
+    for (i=0;i<width;i+=1) {
+        if (i>=end) {
+            start = i;
+            end = MIN(width,i+RPK_CLASS_BLOCK);
+            rpk_classify(px+i*channels,end-i,current,cbuf,channels,simd);
+            rpk_hash_slots(px+i*channels,end-i,sbuf,channels,simd);
+            cls = cbuf;
+            slots = sbuf;
+        }
+        
+        last = current;
+        
+        //Get next pixel. For RGB input alpha stays at its initial 255.
+
+        memcpy(&current,px+i*channels,channels);
+        op = cls[i-start];
+        
+        if (!op) {
+            if (!runtype && run<RPK_MAX_RUN) {
+                run++;
+            } else {
+                rpk_emit(out,buffer,run,runtype,channels,128);
+                run=1;
+                runtype=0;
+            }
+            //Swallow any further copies of current in bulk
+            n = MIN(width-i-1,RPK_MAX_RUN-run);
+            n = pcls ? rpk_zero_run(cls+i+1,n,simd) : rpk_run_length(px+(i+1)*channels,n,channels,simd);
+            run += n;
+            i += n;
+            continue;
+        }
+        diff.rgba = current.rgba^last.rgba;
+        h = slots[i-start];
+        /* Keep extending a type 1 run ahead of the cache lookup, but only while it
+         * has room: a full run of 32 must be written out first. Without the run<32
+         * test a 33rd small diff overflowed the run length into the op byte. */
+        if (!(op&RPK_CLS_NO1) && run && run<32 && runtype==1) goto smalldiff;
+        
+        if (EQCOLOR(current,cache[h])) {
+            rpk_emit(out,buffer,run,runtype,channels,h);
+            run=0;
+            runtype=-1;
+        } else {
+            if (!(op&RPK_CLS_NO1) && runtype!=2) {
+                if (run && runtype!=1 || run==32) {
+                    rpk_emit(out,buffer,run,runtype,channels,128);
+                    run=0;
+                }
+                smalldiff:buffer[run++]=(diff.alpha|diff.blue<<2|diff.green<<4|diff.red<<6)&0xFF;
+                runtype=1;
+            } else if (!(op&RPK_CLS_NO2)) {
+                if (run && runtype!=2 || run==32) {
+                    rpk_emit(out,buffer,run,runtype,channels,128);
+                    run=0;
+                }
+                buffer[run*2]=(diff.red<<3|LRS(diff.green,3))&0xFF;
+                buffer[run*2+1]=(diff.green<<5|diff.blue&0x1F)&0xFF;
+                run++;
+                runtype=2;
+            } else {
+                if (run && runtype!=3 || run==32) {
+                    rpk_emit(out,buffer,run,runtype,channels,128);
+                    run=0;
+                }
+                buffer[run*channels]=current.red;
+                buffer[run*channels+1]=current.green;
+                buffer[run*channels+2]=current.blue;
+                if (channels==4) buffer[run*4+3]=current.alpha;
+                run++;
+                runtype=3;
+            }
+            cache[h]=current;
+        }
+    }
+    
+    enc->current = current;
+    enc->runtype = runtype;
+    enc->run = run;
+}
+
+static void rpk_encode_row3(rpk_encoder *enc, const uint8_t *px, size_t width) {
+    rpk_encode_row_n(enc,px,width,NULL,NULL,3);
+}
+
+static void rpk_encode_row4(rpk_encoder *enc, const uint8_t *px, size_t width) {
+    rpk_encode_row_n(enc,px,width,NULL,NULL,4);
+}
+
+static void rpk_encode_classified3(rpk_encoder *enc, const uint8_t *px, size_t width, const uint8_t *cls, const uint8_t *slots) {
+    rpk_encode_row_n(enc,px,width,cls,slots,3);
+}
+
+static void rpk_encode_classified4(rpk_encoder *enc, const uint8_t *px, size_t width, const uint8_t *cls, const uint8_t *slots) {
+    rpk_encode_row_n(enc,px,width,cls,slots,4);
+}
+
+/* Encode one row of width pixels of enc->channels bytes each.
+ * Runs may continue into the next row. */
+void rpk_encode_row(rpk_encoder *enc, const uint8_t *px, size_t width) {
+    if (enc->channels==3) {
+        rpk_encode_row3(enc,px,width);
+    } else {
+        rpk_encode_row4(enc,px,width);
+    }
+}
+
+//Flush all buffers
+void rpk_encode_finish(rpk_encoder *enc) {
+    rpk_emit(enc->out,enc->buffer,enc->run,enc->runtype,enc->channels,0);
+    enc->run = 0;
+    enc->runtype = -1;
+}
+
+//End a stripe: write out the pending run, without the footer byte rpk_encode_finish adds
+static void rpk_encode_flush(rpk_encoder *enc) {
+    rpk_emit(enc->out,enc->buffer,enc->run,enc->runtype,enc->channels,128);
+    enc->run = 0;
+    enc->runtype = -1;
+}
+
+void rpk_decoder_init(rpk_decoder *dec, uint8_t channels) {
+    memset(dec->cache,0,sizeof(dec->cache));
+    dec->current = (color){.alpha=255};
+    dec->run = 0;
+    dec->runtype = 0;
+    dec->channels = channels;
+    dec->simd = rpk_simd();
+    dec->stripe_rows = 0;
+    dec->rows = 0;
+}
+
+/* Store n copies of the pixel c at dst. A 16 pixel pattern is built once
+ * and then stored with fixed-size copies, which compile to wide stores. */
+RPK_INLINE void rpk_fill(uint8_t *dst, color c, size_t n, const uint8_t channels) {
+    uint8_t pat[16*4+1];
+    size_t i,k;
+    if (n==1) {
+        memcpy(dst,&c,channels);
+        return;
+    }
+    for (k=0;k<16;k++) memcpy(pat+k*channels,&c,4);
+    for (i=0;i+16<=n;i+=16) memcpy(dst+i*channels,pat,16*channels);
+    memcpy(dst+i*channels,pat,(n-i)*channels);
+}
+
+//Expand M once for each of the 256 byte values
+#define RPK_REP4(M,b) M(b),M((b)+1),M((b)+2),M((b)+3)
+#define RPK_REP16(M,b) RPK_REP4(M,b),RPK_REP4(M,(b)+4),RPK_REP4(M,(b)+8),RPK_REP4(M,(b)+12)
+#define RPK_REP64(M,b) RPK_REP16(M,b),RPK_REP16(M,(b)+16),RPK_REP16(M,(b)+32),RPK_REP16(M,(b)+48)
+#define RPK_REP256(M) RPK_REP64(M,0),RPK_REP64(M,64),RPK_REP64(M,128),RPK_REP64(M,192)
+
+//XOR masks of the 256 type 1 argument bytes
+#define RPK_T1(b) {.red=LRS(b,6)&3,.green=LRS(b,4)&3,.blue=LRS(b,2)&3,.alpha=(b)&3}
+static const color rpk_type1masks[256] = {RPK_REP256(RPK_T1)};
+#undef RPK_T1
+
+/* Op kinds the decoder tells apart by the op byte alone: cache index, the
+ * three sizes of type 0 run header, and runs of type 1, 2 and 3. */
+#define RPK_OP_INDEX 0
+#define RPK_OP_RUN0 1
+#define RPK_OP_RUN0_2 2
+#define RPK_OP_RUN0_3 3
+#define RPK_OP_RUN1 4
+#define RPK_OP_RUN2 5
+#define RPK_OP_RUN3 6
+#define RPK_OPKIND(c) ((c)<128 ? RPK_OP_INDEX : (c)<144 ? RPK_OP_RUN0 : (c)<152 ? RPK_OP_RUN0_2 :\
+                       (c)<160 ? RPK_OP_RUN0_3 : (c)<192 ? RPK_OP_RUN1 : (c)<224 ? RPK_OP_RUN2 : RPK_OP_RUN3)
+//Header bytes of each op kind
+static const uint8_t rpk_op_head[7] = {1,1,2,3,1,1,1};
+
+/* Replace each of the n XOR masks in m with the color it yields when the masks
+ * are applied to c one after another. That is a prefix XOR, which SSE2 does 4
+ * lanes at a time in two shifted XORs plus the carry from the lanes before. */
+static void rpk_prefix_xor(color *m, size_t n, color c, int simd) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i x,carry = _mm_set1_epi32(c.rgba);
+    for (;simd>=RPK_SIMD_SSE2 && i+4<=n;i+=4) {
+        x = _mm_loadu_si128((const __m128i *)(m+i));
+        x = _mm_xor_si128(x,_mm_slli_si128(x,4));
+        x = _mm_xor_si128(x,_mm_slli_si128(x,8));
+        x = _mm_xor_si128(x,carry);
+        _mm_storeu_si128((__m128i *)(m+i),x);
+        carry = _mm_shuffle_epi32(x,0xFF);
+    }
+    if (i) c = m[i-1];
+#endif
+    for (;i<n;i++) {
+        c.rgba ^= m[i].rgba;
+        m[i] = c;
+    }
+}
+
+/* Jump to the handler for op byte c (or, in RPK_RESUME, to the body of a run
+ * of type c). Every handler ends in its own dispatch, so the branch predictor
+ * sees which op tends to follow which. By default the op is found with range
+ * tests on c. With RPK_COMPUTED_GOTO, GCC and Clang instead jump through a
+ * 256-entry table of handler addresses indexed by c. On our test images the
+ * range tests won (indirect jumps mispredicted more than the conditional
+ * branches did), but that depends on the CPU and the content. */
+#if defined(RPK_COMPUTED_GOTO) && defined(__GNUC__)
+#define RPK_DISPATCH(c) goto *rpk_op_labels[c]
+#define RPK_RESUME(c) goto *rpk_run_labels[c]
+//A function holding label addresses can't be inlined, so the decoder isn't instantiated per channel count
+#define RPK_DECODE_INLINE static
+#define RPK_OPLABEL(c) (RPK_OPKIND(c)==RPK_OP_INDEX ? &&op_index : RPK_OPKIND(c)==RPK_OP_RUN0 ? &&op_run0 :\
+                        RPK_OPKIND(c)==RPK_OP_RUN0_2 ? &&op_run0_2 : RPK_OPKIND(c)==RPK_OP_RUN0_3 ? &&op_run0_3 :\
+                        RPK_OPKIND(c)==RPK_OP_RUN1 ? &&op_run1 : RPK_OPKIND(c)==RPK_OP_RUN2 ? &&op_run2 : &&op_run3)
+#else
+#define RPK_DISPATCH(c) if ((c)<128) goto op_index;\
+                        else if ((c)>=160) {\
+                            if ((c)<192) goto op_run1;\
+                            else if ((c)<224) goto op_run2;\
+                            else goto op_run3;\
+                        } else if ((c)<144) goto op_run0;\
+                        else if ((c)<152) goto op_run0_2;\
+                        else goto op_run0_3
+#define RPK_DECODE_INLINE RPK_INLINE
+#define RPK_RESUME(c) switch (c) {\
+                          case 0: goto run0;\
+                          case 3: goto run3;\
+                          default: goto run12;\
+                      }
+#endif
+
+//Finish an op: stop at the end of the row, else dispatch the next op from here
+#define RPK_NEXT if (i>=width) goto done;\
+                 /*Headers are at most 3 bytes, so one test covers all but the end of the input*/\
+                 if (end-p<3) {\
+                     RPK_NEED(1);\
+                     RPK_NEED(rpk_op_head[RPK_OPKIND(*p)]);\
+                 }\
+                 RPK_DISPATCH(*p)
+
+/* Decoder loop over one row of packed RGB or RGBA pixels. As in the encoder,
+ * channels is always a constant (unless RPK_COMPUTED_GOTO is set), so pixel
+ * copies and strides are fixed. */
+RPK_DECODE_INLINE int rpk_decode_row_n(rpk_decoder *dec, rpk_reader *in, uint8_t *row, size_t width, const uint8_t channels) {
+#if defined(RPK_COMPUTED_GOTO) && defined(__GNUC__)
+    static const void *const rpk_op_labels[256] = {RPK_REP256(RPK_OPLABEL)};
+    static const void *const rpk_run_labels[] = {&&run0,&&run12,&&run12,&&run3};
+#endif
+    color *cache = dec->cache;
+    color current = dec->current;
+    const uint8_t *p = in->p;
+    const uint8_t *end = in->end;
+    size_t i,n,k;
+    uint8_t slots[32];
+    color masks[32];
+    //Type 1 arguments carry alpha bits that 3 channel images ignore
+    color keep = (color){.red = 0xFF,.green = 0xFF,.blue = 0xFF,.alpha = channels>3 ? 0xFF : 0};
+    uint8_t runtype = dec->runtype;
+    uint32_t run = dec->run;
+    //Batches here are at most 32 pixels, too few to pay for calling the AVX2 kernels
+    const int simd = MIN(dec->simd,RPK_SIMD_SSE2);
+    
+    //A run left over from the previous row is picked up where it stopped.
+    //Every handler finishes its run or the row, so this is the only place.
+    i = 0;
+    if (run && width) RPK_RESUME(runtype);
+    RPK_NEXT;
+    
+    op_index:
+        current = cache[*p++];
+        memcpy(row+i*channels,&current,channels);
+        i++;
+        RPK_NEXT;
+    op_run0_3:
+        run = ((*p&7)<<16|p[1]<<8|p[2])+2065;
+        p += 3;
+        runtype = 0;
+        goto run0;
+    op_run0_2:
+        run = ((*p&7)<<8|p[1])+17;
+        p += 2;
+        runtype = 0;
+        goto run0;
+    op_run0:
+        run = (*p&15)+1;
+        p++;
+        runtype = 0;
+    run0:
+        //Fill the rest of the run, or of the row, in one go
+        n = MIN(run,width-i);
+        rpk_fill(row+i*channels,current,n,channels);
+        cache[HASH(current)]=current;
+        run -= n;
+        i += n;
+        RPK_NEXT;
+    op_run3:
+        run = (*p&31)+1;
+        p++;
+        runtype = 3;
+    run3:
+        //Copy the literals straight into the row, then cache them in order
+        n = MIN(run,width-i);
+        RPK_NEED(n*channels);
+        memcpy(row+i*channels,p,n*channels);
+        rpk_hash_slots(p,n,slots,channels,simd);
+        for (k=0;k<n;k++) {
+            memcpy(&current,p+k*channels,channels);
+            cache[slots[k]]=current;
+        }
+        p += n*channels;
+        run -= n;
+        i += n;
+        RPK_NEXT;
+    op_run1:
+        run = (*p&31)+1;
+        p++;
+        runtype = 1;
+        goto run12;
+    op_run2:
+        run = (*p&31)+1;
+        p++;
+        runtype = 2;
+    run12:
+        //Expand the arguments to XOR masks, scan them into colors, then store and cache those
+        n = MIN(run,width-i);
+        RPK_NEED(n*runtype);
+        if (runtype==1) {
+            for (k=0;k<n;k++) masks[k].rgba = rpk_type1masks[p[k]].rgba&keep.rgba;
+        } else {
+            for (k=0;k<n;k++) {
+                masks[k] = (color){.red = LRS(p[2*k],3)&0x1F,
+                                   .green = (p[2*k]&7)<<3|LRS(p[2*k+1],5),
+                                   .blue = p[2*k+1]&0x1F};
+            }
+        }
+        p += n*runtype;
+        if (n<8) {
+            //Too short for the scan to pay off
+            for (k=0;k<n;k++) {
+                current.rgba ^= masks[k].rgba;
+                memcpy(row+(i+k)*channels,&current,channels);
+                cache[HASH(current)]=current;
+            }
+        } else {
+            rpk_prefix_xor(masks,n,current,simd);
+            rpk_hash_slots((const uint8_t *)masks,n,slots,4,simd);
+            for (k=0;k<n;k++) {
+                memcpy(row+(i+k)*channels,&masks[k],channels);
+                cache[slots[k]]=masks[k];
+            }
+            current = masks[n-1];
+        }
+        run -= n;
+        i += n;
+        RPK_NEXT;
+
+    done:
+    in->p = p;
+    dec->current = current;
+    dec->runtype = runtype;
+    dec->run = run;
+    return 0;
+}
+
+static int rpk_decode_row3(rpk_decoder *dec, rpk_reader *in, uint8_t *row, size_t width) {
+    return rpk_decode_row_n(dec,in,row,width,3);
+}
+
+static int rpk_decode_row4(rpk_decoder *dec, rpk_reader *in, uint8_t *row, size_t width) {
+    return rpk_decode_row_n(dec,in,row,width,4);
+}
+
+//Decode one row of width pixels of dec->channels bytes each into row
+int rpk_decode_row(rpk_decoder *dec, rpk_reader *in, uint8_t *row, size_t width) {
+    uint32_t stripe_rows = dec->stripe_rows;
+    //The next stripe starts where the last one ended, with fresh state
+    if (stripe_rows && dec->rows++==stripe_rows) {
+        rpk_decoder_init(dec,dec->channels);
+        dec->stripe_rows = stripe_rows;
+        dec->rows = 1;
+    }
+    if (dec->channels==3) {
+        return rpk_decode_row3(dec,in,row,width);
+    } else {
+        return rpk_decode_row4(dec,in,row,width);
+    }
+}
+
+
+/* Bounded single-producer/single-consumer queue of row buffers that connects
+ * the two stages of a pipelined conversion. head and tail only ever grow and
+ * each is written by one side only, so neither side takes a lock. */
+typedef struct {
+    _Alignas(64) atomic_size_t head;    //rows committed by the producer
+    _Alignas(64) atomic_size_t tail;    //rows released by the consumer
+    _Alignas(64) atomic_int state;      //RPK_RING_OPEN, _DONE or _ABORT
+    int err;                            //producer's result, valid once state is DONE
+    uint8_t *rows;
+    size_t rowlen;
+} rpk_ring;
+
+#define RPK_RING_OPEN 0
+#define RPK_RING_DONE 1
+#define RPK_RING_ABORT 2
+
+static int rpk_ring_init(rpk_ring *r, size_t rowlen) {
+    atomic_init(&r->head,0);
+    atomic_init(&r->tail,0);
+    atomic_init(&r->state,RPK_RING_OPEN);
+    r->err = 0;
+    r->rowlen = rowlen;
+    r->rows = rpk_alloc(RPK_RING_ROWS*rowlen);
+    return r->rows ? 0 : -1;
+}
+
+//Spin briefly, then start giving the core away
+static void rpk_backoff(unsigned *spins) {
+    if (++*spins < 64) {
+#if defined(__x86_64__)||defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        sched_yield();
+    }
+}
+
+//Producer: wait for a free row buffer. Returns NULL if the consumer gave up.
+static uint8_t *rpk_ring_acquire(rpk_ring *r) {
+    size_t head = atomic_load_explicit(&r->head,memory_order_relaxed);
+    unsigned spins = 0;
+    while (head-atomic_load_explicit(&r->tail,memory_order_acquire) >= RPK_RING_ROWS) {
+        if (atomic_load_explicit(&r->state,memory_order_relaxed)==RPK_RING_ABORT) return NULL;
+        rpk_backoff(&spins);
+    }
+    return r->rows+(head%RPK_RING_ROWS)*r->rowlen;
+}
+
+//Producer: hand the buffer from rpk_ring_acquire to the consumer
+static void rpk_ring_commit(rpk_ring *r) {
+    atomic_fetch_add_explicit(&r->head,1,memory_order_release);
+}
+
+//Producer: no more rows will come. err is passed on to the consumer.
+static void rpk_ring_finish(rpk_ring *r, int err) {
+    r->err = err;
+    atomic_store_explicit(&r->state,RPK_RING_DONE,memory_order_release);
+}
+
+/* Consumer: wait for the next filled row buffer. Returns NULL once the producer
+ * has finished and every row has been consumed. */
+static const uint8_t *rpk_ring_peek(rpk_ring *r) {
+    size_t tail = atomic_load_explicit(&r->tail,memory_order_relaxed);
+    unsigned spins = 0;
+    while (tail==atomic_load_explicit(&r->head,memory_order_acquire)) {
+        if (atomic_load_explicit(&r->state,memory_order_acquire)==RPK_RING_DONE &&
+            tail==atomic_load_explicit(&r->head,memory_order_acquire)) {
+            return NULL;
+        }
+        rpk_backoff(&spins);
+    }
+    return r->rows+(tail%RPK_RING_ROWS)*r->rowlen;
+}
+
+//Consumer: give the buffer from rpk_ring_peek back to the producer
+static void rpk_ring_release(rpk_ring *r) {
+    atomic_fetch_add_explicit(&r->tail,1,memory_order_release);
+}
+
+//Consumer: stop early, unblocking a producer waiting for space
+static void rpk_ring_abort(rpk_ring *r) {
+    atomic_store_explicit(&r->state,RPK_RING_ABORT,memory_order_relaxed);
+}
+
+
+/* Minimal thread pool. Jobs are embedded as the first member of a larger
+ * struct and run in submission order by whichever worker is free. */
+typedef struct rpk_job {
+    void (*run)(struct rpk_job *);
+    struct rpk_job *next;
+    int done;
+} rpk_job;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    rpk_job *head;
+    rpk_job *tail;
+    int stop;
+    unsigned nthreads;
+    pthread_t *threads;
+} rpk_pool;
+
+//Resolve a requested thread count, 0 meaning one per online CPU
+static unsigned rpk_threads(unsigned threads) {
+    long n;
+    if (threads) return threads;
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n>0 ? n : 1;
+}
+
+static void *rpk_pool_thread(void *arg) {
+    rpk_pool *pool = arg;
+    rpk_job *job;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->head && !pool->stop) pthread_cond_wait(&pool->work,&pool->lock);
+        if (!pool->head) break;
+        job = pool->head;
+        pool->head = job->next;
+        pthread_mutex_unlock(&pool->lock);
+        job->run(job);
+        pthread_mutex_lock(&pool->lock);
+        job->done = 1;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void rpk_pool_free(rpk_pool *pool) {
+    unsigned i;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i=0;i<pool->nthreads;i++) pthread_join(pool->threads[i],NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+}
+
+static int rpk_pool_init(rpk_pool *pool, unsigned nthreads) {
+    memset(pool,0,sizeof(*pool));
+    pthread_mutex_init(&pool->lock,NULL);
+    pthread_cond_init(&pool->work,NULL);
+    pthread_cond_init(&pool->done,NULL);
+    if (!(pool->threads = malloc(nthreads*sizeof(pthread_t)))) {
+        rpk_pool_free(pool);
+        return -1;
+    }
+    for (;pool->nthreads<nthreads;pool->nthreads++) {
+        if (pthread_create(pool->threads+pool->nthreads,NULL,rpk_pool_thread,pool)) break;
+    }
+    if (!pool->nthreads) {
+        rpk_pool_free(pool);
+        return -1;
+    }
+    return 0;
+}
+
+static void rpk_pool_submit(rpk_pool *pool, rpk_job *job) {
+    job->next = NULL;
+    job->done = 0;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->head) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void rpk_pool_wait(rpk_pool *pool, rpk_job *job) {
+    pthread_mutex_lock(&pool->lock);
+    while (!job->done) pthread_cond_wait(&pool->done,&pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+//ctx must be decoding to SPNG_FMT_RGB8 for 3 channels and SPNG_FMT_RGBA8 for 4
+int rpk_encode(spng_ctx *ctx, size_t width, rpk_writer *out, uint8_t channels) {
+    rpk_encoder enc;
+    uint8_t *row = rpk_alloc(width*channels);
+    void (*encode_row)(rpk_encoder *,const uint8_t *,size_t) = channels==3 ? rpk_encode_row3 : rpk_encode_row4;
+    int ret;
+
+    if (!row) return -1;
+    rpk_encoder_init(&enc,out,channels);
+    
+    /*spng_decode_row is a bad API. a sane API would return 0 after every successful read
+      instead of returning SPNG_EOI along with the last row*/
+    do {
+        ret = spng_decode_row(ctx, row, channels*width);
+        if (ret && ret != SPNG_EOI) break;
+        encode_row(&enc,row,width);
+    } while (!ret);
+    rpk_encode_finish(&enc);
+    
+    free(row);
+    return ret!=SPNG_EOI||out->err;
+}
+
+typedef struct {
+    rpk_ring ring;
+    spng_ctx *ctx;
+} rpk_png_source;
+
+//Producer thread for rpk_encode_threaded: inflate and unfilter PNG rows into the ring
+static void *rpk_png_source_thread(void *arg) {
+    rpk_png_source *src = arg;
+    uint8_t *row;
+    int ret;
+
+    do {
+        if (!(row = rpk_ring_acquire(&src->ring))) return NULL;
+        ret = spng_decode_row(src->ctx, row, src->ring.rowlen);
+        if (ret && ret != SPNG_EOI) {
+            rpk_ring_finish(&src->ring,-1);
+            return NULL;
+        }
+        rpk_ring_commit(&src->ring);
+    } while (!ret);
+    rpk_ring_finish(&src->ring,0);
+    return NULL;
+}
+
+/* Same as rpk_encode, but libspng decodes rows on a second thread while this
+ * one encodes, so conversion takes about as long as the slower of the two. */
+int rpk_encode_threaded(spng_ctx *ctx, size_t width, rpk_writer *out, uint8_t channels) {
+    rpk_encoder enc;
+    rpk_png_source src;
+    pthread_t thread;
+    const uint8_t *row;
+    void (*encode_row)(rpk_encoder *,const uint8_t *,size_t) = channels==3 ? rpk_encode_row3 : rpk_encode_row4;
+
+    src.ctx = ctx;
+    if (rpk_ring_init(&src.ring,channels*width)) return -1;
+    if (pthread_create(&thread,NULL,rpk_png_source_thread,&src)) {
+        free(src.ring.rows);
+        return -1;
+    }
+
+    rpk_encoder_init(&enc,out,channels);
+    while ((row = rpk_ring_peek(&src.ring))) {
+        encode_row(&enc,row,width);
+        rpk_ring_release(&src.ring);
+    }
+    rpk_encode_finish(&enc);
+
+    pthread_join(thread,NULL);
+    free(src.ring.rows);
+    return src.ring.err||out->err;
+}
+
+//Big-endian 64-bit numbers of the stripe table and footer
+static void rpk_put64(uint8_t *p, uint64_t v) {
+    int i;
+    for (i=7;i>=0;i--,v>>=8) p[i] = v&0xFF;
+}
+
+static uint64_t rpk_get64(const uint8_t *p) {
+    uint64_t v = 0;
+    int i;
+    for (i=0;i<8;i++) v = v<<8|p[i];
+    return v;
+}
+
+static size_t rpk_tile_cols(const rpk_desc *desc) {
+    return desc->width/desc->tile_width+(desc->width%desc->tile_width!=0);
+}
+
+//Entries but one of the stripe table or tile directory: the stripes, or the tiles
+static size_t rpk_stripe_count(const rpk_desc *desc) {
+    if (desc->tile_width) {
+        return rpk_tile_cols(desc)*(desc->height/desc->tile_height+(desc->height%desc->tile_height!=0));
+    }
+    return desc->height/desc->stripe_rows+(desc->height%desc->stripe_rows!=0);
+}
+
+//rpk_put for blocks of any size: with a file, big ones bypass buf
+static void rpk_put_block(rpk_writer *w, const void *data, size_t n) {
+    if (!w->file) {
+        //After a failed realloc buf may be too small for the block, which is lost like the rest
+        rpk_reserve(w,n);
+        if (w->err) {
+            w->flushed += n;
+            return;
+        }
+    }
+    if (!w->file||n<=w->cap) {
+        rpk_put(w,data,n);
+        return;
+    }
+    rpk_flush(w);
+    if (!w->err && fwrite(data,1,n,w->file)!=n) w->err = 1;
+    w->flushed += n;
+}
+
+/* Write the stripe table of count stripes and the footer pointing to it.
+ * offsets holds count+1 file offsets, the last one being where the table goes. */
+static void rpk_write_stripe_table(rpk_writer *out, const uint64_t *offsets, size_t count) {
+    uint8_t b[8];
+    size_t i;
+    for (i=0;i<=count;i++) {
+        rpk_put64(b,offsets[i]);
+        rpk_put(out,b,8);
+    }
+    rpk_put64(b,offsets[count]);
+    rpk_put(out,b,8);
+}
+
+/* Read the stripe table of the striped file of len bytes at data. Returns its
+ * count+1 offsets in a malloc'd array, or NULL if the table is missing or
+ * doesn't add up. */
+static uint64_t *rpk_read_stripe_table(const uint8_t *data, size_t len, const rpk_desc *desc) {
+    size_t count = rpk_stripe_count(desc), i;
+    size_t first = desc->tile_width ? RPK_TILED_HEADER_SIZE : RPK_STRIPED_HEADER_SIZE;
+    uint64_t table, *offsets;
+
+    if (len<first+16||(len-first-8)/8<count+1) return NULL;
+    table = rpk_get64(data+len-8);
+    if (table!=len-8-8*(count+1)||!(offsets = malloc((count+1)*sizeof(*offsets)))) return NULL;
+    for (i=0;i<=count;i++) {
+        offsets[i] = rpk_get64(data+table+8*i);
+        if (i ? offsets[i]<offsets[i-1] : offsets[i]!=first) break;
+    }
+    if (i<=count||offsets[count]!=table) {
+        free(offsets);
+        return NULL;
+    }
+    return offsets;
+}
+
+//Where the encoders get their rows from: ctx if it is set, pixels (stride bytes apart) otherwise
+typedef struct {
+    const rpk_desc *desc;
+    spng_ctx *ctx;
+    const uint8_t *pixels;
+    size_t stride;
+} rpk_source;
+
+/* Rows y to y+n-1 of the source, decoded from the PNG into raw (rowlen bytes
+ * apart) or found in pixels. Returns the first of them, NULL on a PNG error. */
+static const uint8_t *rpk_source_rows(const rpk_source *src, uint8_t *raw, size_t y, size_t n) {
+    size_t rowlen = (size_t)src->desc->width*src->desc->channels, i;
+    int ret;
+
+    if (!src->ctx) return src->pixels+y*src->stride;
+    for (i=0;i<n;i++) {
+        //spng_decode_row returns SPNG_EOI with the last row
+        ret = spng_decode_row(src->ctx,raw+i*rowlen,rowlen);
+        if (ret && (ret!=SPNG_EOI||y+i+1!=src->desc->height)) return NULL;
+    }
+    return raw;
+}
+
+/* Run count jobs on a pool of threads, at most nslots at a time in order:
+ * job i lives in slot i%nslots of slots (size bytes each, rpk_job first).
+ * fill(arg,job,i) sets it up before it is submitted and finish(arg,job,i)
+ * takes it back once it has run; either returns nonzero to stop. Jobs still
+ * in flight then finish before this returns, so the slots can be freed. */
+static int rpk_pool_run(unsigned threads, size_t count, void *slots, size_t nslots, size_t size,
+                        int (*fill)(void *, rpk_job *, size_t), int (*finish)(void *, rpk_job *, size_t), void *arg) {
+    rpk_pool pool;
+    rpk_job *job;
+    size_t next = 0, done = 0;
+    int err = 0;
+
+    if (rpk_pool_init(&pool,threads)) return -1;
+    while (!err && done<count) {
+        //Fill every free slot, then hand them to the pool
+        while (!err && next<count && next-done<nslots) {
+            job = (rpk_job *)((uint8_t *)slots+next%nslots*size);
+            if (fill(arg,job,next)) {
+                err = 1;
+            } else {
+                rpk_pool_submit(&pool,job);
+                next++;
+            }
+        }
+        if (err) break;
+        //Take the oldest job as soon as it has run
+        job = (rpk_job *)((uint8_t *)slots+done%nslots*size);
+        rpk_pool_wait(&pool,job);
+        if (finish(arg,job,done++)) err = 1;
+    }
+    for (;done<next;done++) rpk_pool_wait(&pool,(rpk_job *)((uint8_t *)slots+done%nslots*size));
+    rpk_pool_free(&pool);
+    return err ? -1 : 0;
+}
+
+/* Encode the body of a tiled file: the tiles, the tile directory and the
+ * footer. The header must be in out already. Rows come from ctx if it is set
+ * and from pixels (stride bytes apart) otherwise. Every tile column has its
+ * own encoder and buffer, and at the end of each row of tiles the buffers are
+ * appended to out left to right. */
+static int rpk_encode_tiles(rpk_writer *out, const rpk_desc *desc, spng_ctx *ctx, const uint8_t *pixels, size_t stride) {
+    rpk_source src = {desc,ctx,pixels,stride};
+    size_t cols = rpk_tile_cols(desc), count = rpk_stripe_count(desc), n = 0, tx, tw;
+    size_t rowlen = (size_t)desc->width*desc->channels;
+    rpk_writer *bufs = calloc(MAX(cols,1),sizeof(*bufs));
+    rpk_encoder *enc = malloc(MAX(cols,1)*sizeof(*enc));
+    uint64_t *offsets = malloc((count+1)*sizeof(*offsets));
+    uint8_t *raw = ctx ? rpk_alloc(rowlen) : NULL;
+    const uint8_t *row;
+    uint32_t y;
+    int err = !bufs||!enc||!offsets||(ctx && !raw);
+
+    for (tx=0;!err && tx<cols;tx++) {
+        if (rpk_writer_init(bufs+tx,NULL)) err = 1;
+    }
+    for (y=0;!err && y<desc->height;y++) {
+        if (y%desc->tile_height==0) {
+            for (tx=0;tx<cols;tx++) {
+                bufs[tx].pos = 0;
+                rpk_encoder_init(enc+tx,bufs+tx,desc->channels);
+            }
+        }
+        if (!(row = rpk_source_rows(&src,raw,y,1))) {
+            err = 1;
+            break;
+        }
+        for (tx=0;tx<cols;tx++) {
+            tw = MIN(desc->tile_width,desc->width-tx*desc->tile_width);
+            rpk_encode_row(enc+tx,row+tx*desc->tile_width*desc->channels,tw);
+        }
+        if ((y+1)%desc->tile_height && y+1<desc->height) continue;
+        //The row of tiles is complete. Like a stripe, a tile isn't appended from a failed buffer or to a failed out
+        for (tx=0;!err && tx<cols;tx++) {
+            rpk_encode_flush(enc+tx);
+            if (bufs[tx].err) {
+                err = 1;
+                break;
+            }
+            offsets[n++] = out->flushed+out->pos;
+            rpk_put_block(out,bufs[tx].buf,bufs[tx].pos);
+            err = out->err;
+        }
+    }
+    if (!err) {
+        offsets[n] = out->flushed+out->pos;
+        rpk_write_stripe_table(out,offsets,count);
+    }
+
+    for (tx=0;bufs && tx<cols;tx++) free(bufs[tx].buf);
+    free(bufs);
+    free(enc);
+    free(offsets);
+    free(raw);
+    return err||out->err ? -1 : 0;
+}
+
+//Decode one th rows high, tw pixels wide tile coded in data[start,end) into px
+static int rpk_decode_tile_at(const uint8_t *data, uint64_t start, uint64_t end, const rpk_desc *desc,
+                              size_t tw, size_t th, uint8_t *px, size_t stride) {
+    rpk_reader in = {data+start,data+end};
+    rpk_decoder dec;
+    size_t y;
+
+    rpk_decoder_init(&dec,desc->channels);
+    for (y=0;y<th;y++) {
+        if (rpk_decode_row(&dec,&in,px+y*stride,tw)) return -1;
+    }
+    return 0;
+}
+
+/* Decode tile (tx,ty) of the in-memory tiled file of len bytes into pixels, in
+ * rows stride bytes apart. Tiles are desc->tile_width x desc->tile_height
+ * pixels, less at the right and bottom edges of the image. Only the header,
+ * two directory entries and the tile itself are read, so a viewer can map a
+ * huge file and pick out the tiles on screen. Fills in *desc and returns 0 on
+ * success, -1 if the data is not a valid tiled file or has no such tile. */
+int rpk_decode_tile(const void *data, size_t len, uint32_t tx, uint32_t ty, void *pixels, size_t stride, rpk_desc *desc) {
+    rpk_reader in = {data,(const uint8_t *)data+len};
+    const uint8_t *d = data;
+    size_t cols, count, tw, th, i;
+    uint64_t table, start, end;
+
+    if (rpk_read_header(&in,desc)||!desc->tile_width) return -1;
+    cols = rpk_tile_cols(desc);
+    count = rpk_stripe_count(desc);
+    if (tx>=cols||(uint64_t)ty*desc->tile_height>=desc->height) return -1;
+    tw = MIN(desc->tile_width,desc->width-tx*desc->tile_width);
+    th = MIN(desc->tile_height,desc->height-ty*desc->tile_height);
+    if (stride<tw*desc->channels) return -1;
+    //Just the tile's own entries of the directory
+    if (len<RPK_TILED_HEADER_SIZE+16||(len-RPK_TILED_HEADER_SIZE-8)/8<count+1) return -1;
+    table = rpk_get64(d+len-8);
+    if (table!=len-8-8*(count+1)) return -1;
+    i = (size_t)ty*cols+tx;
+    start = rpk_get64(d+table+8*i);
+    end = rpk_get64(d+table+8*i+8);
+    if (start<RPK_TILED_HEADER_SIZE||start>end||end>table) return -1;
+    return rpk_decode_tile_at(d,start,end,desc,tw,th,pixels,stride);
+}
+
+//Decode every tile of the in-memory tiled file of len bytes into pixels, rows stride bytes apart
+static int rpk_decode_tiles(const uint8_t *data, size_t len, uint8_t *pixels, size_t stride, const rpk_desc *desc) {
+    uint64_t *dir = rpk_read_stripe_table(data,len,desc);
+    size_t cols = rpk_tile_cols(desc), count = rpk_stripe_count(desc), i, tx, ty;
+    int err = !dir;
+
+    for (i=0;!err && i<count;i++) {
+        tx = i%cols;
+        ty = i/cols;
+        err = rpk_decode_tile_at(data,dir[i],dir[i+1],desc,
+                                 MIN(desc->tile_width,desc->width-tx*desc->tile_width),
+                                 MIN(desc->tile_height,desc->height-ty*desc->tile_height),
+                                 pixels+ty*desc->tile_height*stride+tx*desc->tile_width*desc->channels,stride);
+    }
+    free(dir);
+    return err ? -1 : 0;
+}
+
+/* Whole rows of a mapped tiled file, for the row by row writers: a decoder per
+ * tile column works through its tile of the current row of tiles. */
+typedef struct {
+    const rpk_desc *desc;
+    const uint8_t *data;
+    uint64_t *dir;      //tile directory
+    rpk_decoder *dec;
+    rpk_reader *in;
+    size_t cols;
+    uint32_t y;         //next row
+} rpk_tile_rows;
+
+static void rpk_tile_rows_free(rpk_tile_rows *t) {
+    free(t->dir);
+    free(t->dec);
+    free(t->in);
+    t->dir = NULL;
+    t->dec = NULL;
+    t->in = NULL;
+}
+
+static int rpk_tile_rows_init(rpk_tile_rows *t, const rpk_reader *in, const rpk_desc *desc) {
+    memset(t,0,sizeof(*t));
+    t->desc = desc;
+    t->data = in->buf;
+    t->cols = rpk_tile_cols(desc);
+    if (!in->mapped||!(t->dir = rpk_read_stripe_table(in->buf,in->cap,desc))||
+        !(t->dec = malloc(MAX(t->cols,1)*sizeof(*t->dec)))||!(t->in = calloc(MAX(t->cols,1),sizeof(*t->in)))) {
+        rpk_tile_rows_free(t);
+        return -1;
+    }
+    return 0;
+}
+
+//Decode the next row of the image into row
+static int rpk_tile_rows_next(rpk_tile_rows *t, uint8_t *row) {
+    const rpk_desc *desc = t->desc;
+    size_t tx, i;
+
+    if (t->y>=desc->height) return -1;
+    if (t->y%desc->tile_height==0) {
+        //Start on the next row of tiles
+        for (tx=0;tx<t->cols;tx++) {
+            i = (size_t)(t->y/desc->tile_height)*t->cols+tx;
+            rpk_decoder_init(t->dec+tx,desc->channels);
+            t->in[tx].p = t->data+t->dir[i];
+            t->in[tx].end = t->data+t->dir[i+1];
+        }
+    }
+    t->y++;
+    for (tx=0;tx<t->cols;tx++) {
+        if (rpk_decode_row(t->dec+tx,t->in+tx,row+tx*desc->tile_width*desc->channels,
+                           MIN(desc->tile_width,desc->width-tx*desc->tile_width))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int rpk_decode(rpk_reader *in, const rpk_desc *desc, spng_ctx *ctx, size_t *outlen) {
+    rpk_decoder dec;
+    rpk_tile_rows tiles = {0};
+    size_t width = desc->width;
+    uint8_t channels = desc->channels;
+    uint8_t *row = rpk_alloc(width*channels);
+    int ret;
+    *outlen = 0;
+
+    if (!row||(desc->tile_width && rpk_tile_rows_init(&tiles,in,desc))) {
+        free(row);
+        return -1;
+    }
+    rpk_decoder_init(&dec,channels);
+    dec.stripe_rows = desc->stripe_rows;
+    
+    do { 
+        if (tiles.dec ? rpk_tile_rows_next(&tiles,row) : rpk_decode_row(&dec,in,row,width)) {
+            free(row);
+            rpk_tile_rows_free(&tiles);
+            return -1;
+        }
+        *outlen += channels*width;
+        ret = spng_encode_row(ctx,row,channels*width);
+    } while (!ret);
+    free(row);
+    rpk_tile_rows_free(&tiles);
+    //If we make it here, we're missing an end of bytestream code,
+    //so there is probably something wrong with the file.
+    return !(ret==SPNG_EOI);
+}
+
+
+typedef struct {
+    rpk_ring ring;
+    rpk_decoder dec;
+    rpk_tile_rows tiles;    //used instead of dec for tiled files
+    rpk_reader *in;
+    size_t width;
+    size_t height;
+} rpk_decode_source;
+
+//Producer thread for rpk_decode_threaded: decode RPK rows into the ring
+static void *rpk_decode_source_thread(void *arg) {
+    rpk_decode_source *src = arg;
+    uint8_t *row;
+    size_t y;
+
+    for (y=0;y<src->height;y++) {
+        if (!(row = rpk_ring_acquire(&src->ring))) return NULL;
+        if (src->tiles.dec ? rpk_tile_rows_next(&src->tiles,row) : rpk_decode_row(&src->dec,src->in,row,src->width)) {
+            rpk_ring_finish(&src->ring,-1);
+            return NULL;
+        }
+        rpk_ring_commit(&src->ring);
+    }
+    rpk_ring_finish(&src->ring,0);
+    return NULL;
+}
+
+/* Same as rpk_decode, but RPK rows are decoded on a second thread while this
+ * one drives the PNG encoder, so deflate no longer waits on the decoder. */
+int rpk_decode_threaded(rpk_reader *in, const rpk_desc *desc, spng_ctx *ctx, size_t *outlen) {
+    rpk_decode_source src;
+    pthread_t thread;
+    const uint8_t *row;
+    size_t width = desc->width;
+    uint8_t channels = desc->channels;
+    int ret = 0;
+    *outlen = 0;
+
+    //With no rows for the ring the loop below would never see SPNG_EOI; empty images go the serial way
+    if (!desc->height) return rpk_decode(in,desc,ctx,outlen);
+    src.in = in;
+    src.width = width;
+    src.height = desc->height;
+    rpk_decoder_init(&src.dec,channels);
+    src.dec.stripe_rows = desc->stripe_rows;
+    memset(&src.tiles,0,sizeof(src.tiles));
+    if (desc->tile_width && rpk_tile_rows_init(&src.tiles,in,desc)) return -1;
+    if (rpk_ring_init(&src.ring,channels*width)) {
+        rpk_tile_rows_free(&src.tiles);
+        return -1;
+    }
+    if (pthread_create(&thread,NULL,rpk_decode_source_thread,&src)) {
+        free(src.ring.rows);
+        rpk_tile_rows_free(&src.tiles);
+        return -1;
+    }
+
+    do {
+        //NULL means the decoder stopped before the PNG encoder saw its last row
+        if (!(row = rpk_ring_peek(&src.ring))) break;
+        ret = spng_encode_row(ctx,row,channels*width);
+        rpk_ring_release(&src.ring);
+        *outlen += channels*width;
+    } while (!ret);
+    rpk_ring_abort(&src.ring);
+
+    pthread_join(thread,NULL);
+    free(src.ring.rows);
+    rpk_tile_rows_free(&src.tiles);
+    return src.ring.err||ret!=SPNG_EOI;
+}
+
+/* Checkpoints at the start of every stripe of a striped file, in a malloc'd
+ * array, or NULL if its stripe table is broken. *end is set to where the
+ * stripes end. */
+static rpk_checkpoint *rpk_stripe_checkpoints(const uint8_t *data, size_t len, const rpk_desc *desc, size_t *end) {
+    size_t count = rpk_stripe_count(desc), i;
+    uint64_t *offsets = rpk_read_stripe_table(data,len,desc);
+    rpk_checkpoint *cps = offsets ? malloc(count*sizeof(*cps)) : NULL;
+
+    for (i=0;cps && i<count;i++) {
+        cps[i].offset = offsets[i];
+        cps[i].row = i*desc->stripe_rows;
+        rpk_decoder_init(&cps[i].dec,desc->channels);
+        cps[i].dec.stripe_rows = desc->stripe_rows;
+    }
+    if (cps) *end = offsets[count];
+    free(offsets);
+    return cps;
+}
+
+/* Decode the file of len bytes at data from checkpoint cp on: skip rows are
+ * decoded and dropped, then the next rows rows go to px, stride bytes apart. */
+static int rpk_decode_from(const uint8_t *data, size_t len, const rpk_checkpoint *cp, const rpk_desc *desc,
+                           uint32_t skip, uint8_t *px, size_t stride, uint32_t rows) {
+    rpk_reader in = {data+cp->offset,data+len};
+    rpk_decoder dec = cp->dec;
+    uint8_t *row = NULL;
+    uint32_t y;
+    int err = 0;
+
+    if (skip && !(row = rpk_alloc((size_t)desc->width*desc->channels))) return -1;
+    for (y=0;y<skip && !err;y++) err = rpk_decode_row(&dec,&in,row,desc->width);
+    for (y=0;y<rows && !err;y++) err = rpk_decode_row(&dec,&in,px+y*stride,desc->width);
+    free(row);
+    return err ? -1 : 0;
+}
+
+//One stripe being encoded, or one stretch of rows between checkpoints being decoded, by the pool
+typedef struct {
+    rpk_job job;
+    const rpk_desc *desc;
+    uint8_t *px;        //first row of the stripe
+    size_t stride;
+    uint32_t rows;
+    uint8_t *raw;       //encoding from a PNG: room for the stripe's rows, which px then points to
+    rpk_writer out;     //encoding: the coded stripe
+    const uint8_t *data;//decoding: the file, len bytes,
+    size_t len;
+    const rpk_checkpoint *start;    //decoded from here on
+    int err;
+} rpk_stripe;
+
+static void rpk_encode_stripe_run(rpk_job *job) {
+    rpk_stripe *s = (rpk_stripe *)job;
+    rpk_encoder enc;
+    uint32_t y;
+
+    s->out.pos = 0;
+    rpk_encoder_init(&enc,&s->out,s->desc->channels);
+    for (y=0;y<s->rows;y++) rpk_encode_row(&enc,s->px+y*s->stride,s->desc->width);
+    rpk_encode_flush(&enc);
+}
+
+static void rpk_decode_stripe_run(rpk_job *job) {
+    rpk_stripe *s = (rpk_stripe *)job;
+    s->err = rpk_decode_from(s->data,s->len,s->start,s->desc,0,s->px,s->stride,s->rows);
+}
+
+//rpk_encode_stripes' state for rpk_pool_run
+typedef struct {
+    rpk_source src;
+    rpk_writer *out;
+    uint64_t *offsets;
+} rpk_stripe_run;
+
+static int rpk_stripe_fill(void *arg, rpk_job *job, size_t i) {
+    rpk_stripe_run *r = arg;
+    rpk_stripe *s = (rpk_stripe *)job;
+    size_t y = i*r->src.desc->stripe_rows;
+
+    s->rows = MIN(r->src.desc->stripe_rows,r->src.desc->height-y);
+    return !(s->px = (uint8_t *)rpk_source_rows(&r->src,s->raw,y,s->rows));
+}
+
+//Append the stripe to out as soon as it is encoded
+static int rpk_stripe_finish(void *arg, rpk_job *job, size_t i) {
+    rpk_stripe_run *r = arg;
+    rpk_stripe *s = (rpk_stripe *)job;
+
+    if (s->out.err) return 1;
+    rpk_put_block(r->out,s->out.buf,s->out.pos);
+    r->offsets[i+1] = r->out->flushed+r->out->pos;
+    return 0;
+}
+
+/* Encode the body of a striped file: the stripes of desc->height rows, the
+ * stripe table and the footer. The header must be in out already. Rows come
+ * from ctx if it is set and from pixels (stride bytes apart) otherwise. The
+ * pool encodes up to 2*threads stripes at a time, each into its own buffer,
+ * and they are appended to out in order as they come back. */
+static int rpk_encode_stripes(rpk_writer *out, const rpk_desc *desc, spng_ctx *ctx, const uint8_t *pixels, size_t stride, unsigned threads) {
+    rpk_stripe_run run = {{desc,ctx,pixels,stride},out};
+    rpk_stripe *stripes = NULL, *s;
+    size_t rowlen = (size_t)desc->width*desc->channels;
+    size_t count = rpk_stripe_count(desc);
+    size_t slots, i;
+    int err = 0;
+
+    threads = MIN(rpk_threads(threads),count);
+    slots = MIN(2*threads,count);
+    if (!(run.offsets = malloc((count+1)*sizeof(*run.offsets)))||!(stripes = calloc(slots,sizeof(*stripes)))) {
+        free(run.offsets);
+        return -1;
+    }
+    for (i=0;i<slots;i++) {
+        s = stripes+i;
+        s->desc = desc;
+        s->job.run = rpk_encode_stripe_run;
+        if (rpk_writer_init(&s->out,NULL)) err = 1;
+        if (ctx && !(s->raw = rpk_alloc(desc->stripe_rows*rowlen))) err = 1;
+        s->stride = ctx ? rowlen : stride;
+    }
+
+    run.offsets[0] = out->flushed+out->pos;
+    if (!err) err = rpk_pool_run(threads,count,stripes,slots,sizeof(*stripes),rpk_stripe_fill,rpk_stripe_finish,&run);
+    if (!err) rpk_write_stripe_table(out,run.offsets,count);
+
+    for (i=0;i<slots;i++) {
+        free(stripes[i].raw);
+        free(stripes[i].out.buf);
+    }
+    free(stripes);
+    free(run.offsets);
+    return err||out->err ? -1 : 0;
+}
+
+/* Rows classified and hashed by the pool for rpk_encode_parallel. The class
+ * bits and cache slots of each row are stored width bytes apart. */
+typedef struct {
+    rpk_job job;
+    const uint8_t *px;  //first row of the block
+    size_t stride;
+    uint32_t width;
+    uint32_t rows;
+    uint8_t channels;
+    uint8_t simd;
+    color last;         //the pixel before the block, as the encoder will have it
+    uint8_t *raw;       //encoding from a PNG: room for the block's rows, which px then points to
+    uint8_t *cls;
+    uint8_t *slots;
+} rpk_rowblock;
+
+RPK_INLINE void rpk_classify_rows_n(rpk_rowblock *b, const uint8_t channels) {
+    const uint8_t *row;
+    color last = b->last;
+    size_t w = b->width;
+    uint32_t y;
+
+    for (y=0;y<b->rows;y++) {
+        row = b->px+y*b->stride;
+        rpk_classify(row,w,last,b->cls+y*w,channels,b->simd);
+        rpk_hash_slots(row,w,b->slots+y*w,channels,b->simd);
+        memcpy(&last,row+(w-1)*channels,channels);
+    }
+}
+
+static void rpk_classify_rows_run(rpk_job *job) {
+    rpk_rowblock *b = (rpk_rowblock *)job;
+    if (b->channels==3) {
+        rpk_classify_rows_n(b,3);
+    } else {
+        rpk_classify_rows_n(b,4);
+    }
+}
+
+//rpk_encode_parallel's state for rpk_pool_run
+typedef struct {
+    rpk_source src;
+    rpk_encoder enc;
+    void (*encode_row)(rpk_encoder *,const uint8_t *,size_t,const uint8_t *,const uint8_t *);
+    size_t block_rows;
+    color last;         //the last pixel of the blocks filled so far
+} rpk_rowblock_run;
+
+static int rpk_rowblock_fill(void *arg, rpk_job *job, size_t i) {
+    rpk_rowblock_run *r = arg;
+    rpk_rowblock *b = (rpk_rowblock *)job;
+    size_t y = i*r->block_rows;
+
+    b->rows = MIN(r->block_rows,r->src.desc->height-y);
+    if (!(b->px = rpk_source_rows(&r->src,b->raw,y,b->rows))) return 1;
+    b->last = r->last;
+    memcpy(&r->last,b->px+(b->rows-1)*b->stride+(b->width-1)*b->channels,b->channels);
+    return 0;
+}
+
+//Sequence the block as soon as it is classified
+static int rpk_rowblock_finish(void *arg, rpk_job *job, size_t i) {
+    rpk_rowblock_run *r = arg;
+    rpk_rowblock *b = (rpk_rowblock *)job;
+    uint32_t y;
+
+    for (y=0;y<b->rows;y++) {
+        r->encode_row(&r->enc,b->px+y*b->stride,b->width,b->cls+y*b->width,b->slots+y*b->width);
+    }
+    return 0;
+}
+
+/* Encode the rows of a single stream exactly as rpk_encode would, with the
+ * pool doing the work that doesn't depend on the encoder state: blocks of
+ * about RPK_ENCODE_BLOCK pixels are classified and hashed, up to 2*threads at
+ * a time, while this thread makes the run and cache decisions for the oldest
+ * one and writes its ops. Rows come from ctx if it is set and from pixels
+ * (stride bytes apart) otherwise. The image must not be empty; the footer is
+ * left to the caller. */
+static int rpk_encode_parallel(rpk_writer *out, const rpk_desc *desc, spng_ctx *ctx, const uint8_t *pixels, size_t stride, unsigned threads) {
+    rpk_rowblock_run run = {{desc,ctx,pixels,stride}};
+    rpk_rowblock *blocks, *b;
+    size_t width = desc->width, rowlen = width*desc->channels;
+    size_t count, slots, i;
+    int err = 0;
+
+    run.encode_row = desc->channels==3 ? rpk_encode_classified3 : rpk_encode_classified4;
+    run.block_rows = MAX(1,RPK_ENCODE_BLOCK/width);
+    run.last = (color){.alpha=255};
+    count = (desc->height+run.block_rows-1)/run.block_rows;
+    threads = MIN(rpk_threads(threads),count);
+    slots = MIN(2*threads,count);
+    if (!(blocks = calloc(slots,sizeof(*blocks)))) return -1;
+    for (i=0;i<slots;i++) {
+        b = blocks+i;
+        b->job.run = rpk_classify_rows_run;
+        b->width = width;
+        b->channels = desc->channels;
+        b->simd = rpk_simd();
+        b->stride = ctx ? rowlen : stride;
+        if (!(b->cls = rpk_alloc(run.block_rows*width))||!(b->slots = rpk_alloc(run.block_rows*width))) err = 1;
+        if (ctx && !(b->raw = rpk_alloc(run.block_rows*rowlen))) err = 1;
+    }
+
+    if (!err) {
+        rpk_encoder_init(&run.enc,out,desc->channels);
+        err = rpk_pool_run(threads,count,blocks,slots,sizeof(*blocks),rpk_rowblock_fill,rpk_rowblock_finish,&run);
+        rpk_encode_finish(&run.enc);
+    }
+
+    for (i=0;i<slots;i++) {
+        free(blocks[i].raw);
+        free(blocks[i].cls);
+        free(blocks[i].slots);
+    }
+    free(blocks);
+    return err||out->err ? -1 : 0;
+}
+
+/* Decode a whole image into pixels (rows stride bytes apart) on a pool of
+ * threads, one job per checkpoint in cps. Checkpoints are seg_rows rows
+ * apart and decoding doesn't read past data+len. */
+static int rpk_decode_segments(const uint8_t *data, size_t len, const rpk_checkpoint *cps, size_t count, uint32_t seg_rows,
+                               uint8_t *pixels, size_t stride, const rpk_desc *desc, unsigned threads) {
+    rpk_pool pool;
+    rpk_stripe *segs;
+    size_t i;
+    int err = 0;
+
+    if (!(segs = calloc(count,sizeof(*segs)))||rpk_pool_init(&pool,MIN(rpk_threads(threads),count))) {
+        free(segs);
+        return -1;
+    }
+    for (i=0;i<count;i++) {
+        segs[i].job.run = rpk_decode_stripe_run;
+        segs[i].desc = desc;
+        segs[i].px = pixels+cps[i].row*stride;
+        segs[i].stride = stride;
+        segs[i].rows = MIN(seg_rows,desc->height-cps[i].row);
+        segs[i].data = data;
+        segs[i].len = len;
+        segs[i].start = cps+i;
+        rpk_pool_submit(&pool,&segs[i].job);
+    }
+    for (i=0;i<count;i++) {
+        rpk_pool_wait(&pool,&segs[i].job);
+        err |= segs[i].err;
+    }
+    rpk_pool_free(&pool);
+    free(segs);
+    return err ? -1 : 0;
+}
+
+/* Join the striped files infiles[0] to infiles[count-1], which hold
+ * consecutive row ranges of one image, into the striped file outfile. The
+ * fragments may be encoded anywhere; their stripes are copied as they are and
+ * only the header height and the stripe table are written anew. Returns 0 on
+ * success, -1 if a fragment can't be read or doesn't fit with the others. */
+int rpk_concat(const char *const *infiles, size_t count, const char *outfile) {
+    rpk_reader *in;
+    uint64_t **tables, *offsets = NULL;
+    rpk_writer out = {0};
+    rpk_desc desc, d;
+    FILE *outf = NULL;
+    size_t stripes = 0, i, j, n;
+    uint64_t base;
+    int err = -1;
+
+    in = calloc(count,sizeof(*in));
+    tables = calloc(count,sizeof(*tables));
+    if (!count||!in||!tables) goto cleanup;
+    //Check every fragment before writing anything
+    for (i=0;i<count;i++) {
+        if (rpk_reader_map(in+i,infiles[i])||rpk_read_header(in+i,&d)||!d.stripe_rows||
+            !(tables[i] = rpk_read_stripe_table(in[i].buf,in[i].cap,&d))) {
+            goto cleanup;
+        }
+        if (!i) {
+            desc = d;
+        } else if (d.width!=desc.width||d.channels!=desc.channels||d.colorspace!=desc.colorspace||
+                   d.stripe_rows!=desc.stripe_rows||desc.height%desc.stripe_rows||d.height>UINT32_MAX-desc.height) {
+            goto cleanup;
+        } else {
+            desc.height += d.height;
+        }
+        stripes += rpk_stripe_count(&d);
+    }
+    if (!(offsets = malloc((stripes+1)*sizeof(*offsets)))||
+        !(outf = fopen(outfile,"wb"))||rpk_writer_init(&out,outf)) {
+        goto cleanup;
+    }
+
+    rpk_write_header(&out,&desc);
+    for (i=0,n=0;i<count;i++) {
+        //Stripe offsets move by where the fragment's stripes now start
+        base = out.flushed+out.pos-RPK_STRIPED_HEADER_SIZE;
+        in[i].p = in[i].buf;
+        rpk_read_header(in+i,&d);
+        for (j=0;j<rpk_stripe_count(&d);j++) offsets[n++] = base+tables[i][j];
+        rpk_put_block(&out,in[i].buf+RPK_STRIPED_HEADER_SIZE,tables[i][j]-RPK_STRIPED_HEADER_SIZE);
+    }
+    offsets[n] = out.flushed+out.pos;
+    rpk_write_stripe_table(&out,offsets,stripes);
+    rpk_flush(&out);
+    err = out.err ? -1 : 0;
+
+    cleanup:
+        for (i=0;i<count && in;i++) {
+            rpk_reader_free(in+i);
+            if (tables) free(tables[i]);
+        }
+        free(in);
+        free(tables);
+        free(offsets);
+        free(out.buf);
+        if (outf && fclose(outf)) err = -1;
+        return err;
+}
+
+/* Sidecar index (.rpki) of a single-stream file, for the random access and
+ * parallel decoding that striped files get from their stripe table. It is
+ * built by decoding the file once and holds a checkpoint every `every` rows,
+ * starting at row 0. All numbers are big-endian, colors are RGBA bytes:
+ *   "rpki", size of the .rpk file (8 bytes), width (4), height (4),
+ *   channels (1), every (4), number of checkpoints (4), then per checkpoint
+ *   offset (8), row (4), run (4), runtype (1), current (4), cache (128*4) */
+typedef struct {
+    uint64_t size;
+    rpk_desc desc;
+    uint32_t every;
+    uint32_t count;
+    rpk_checkpoint *points;
+} rpk_index;
+
+#define RPK_INDEX_HEADER_SIZE 29
+#define RPK_CHECKPOINT_SIZE (8+4+4+1+4+128*4)
+
+void rpk_index_free(rpk_index *idx) {
+    free(idx->points);
+    idx->points = NULL;
+}
+
+//Scan the .rpk file infile and write its sidecar index, with a checkpoint every `every` rows, to outfile
+int rpk_index_write(const char *infile, const char *outfile, uint32_t every) {
+    rpk_reader in;
+    rpk_writer out = {0};
+    rpk_decoder dec;
+    rpk_desc desc;
+    FILE *outf = NULL;
+    uint8_t *row = NULL, b[RPK_INDEX_HEADER_SIZE];
+    uint32_t y, temp;
+    int err = -1;
+
+    if (!every||rpk_reader_map(&in,infile)) return -1;
+    //Striped and tiled files carry their own table
+    if (rpk_read_header(&in,&desc)||desc.colorspace&(RPK_STRIPED|RPK_TILED)||!(row = rpk_alloc((size_t)desc.width*desc.channels))||
+        !(outf = fopen(outfile,"wb"))||rpk_writer_init(&out,outf)) {
+        goto cleanup;
+    }
+    memcpy(b,"rpki",4);
+    rpk_put64(b+4,in.cap);
+    temp = htonl(desc.width);
+    memcpy(b+12,&temp,4);
+    temp = htonl(desc.height);
+    memcpy(b+16,&temp,4);
+    b[20] = desc.channels;
+    temp = htonl(every);
+    memcpy(b+21,&temp,4);
+    temp = htonl(desc.height/every+(desc.height%every!=0));
+    memcpy(b+25,&temp,4);
+    rpk_put(&out,b,RPK_INDEX_HEADER_SIZE);
+
+    rpk_decoder_init(&dec,desc.channels);
+    for (y=0;y<desc.height;y++) {
+        if (y%every==0) {
+            rpk_put64(b,in.p-in.buf);
+            temp = htonl(y);
+            memcpy(b+8,&temp,4);
+            temp = htonl(dec.run);
+            memcpy(b+12,&temp,4);
+            b[16] = dec.runtype;
+            memcpy(b+17,&dec.current,4);
+            rpk_put(&out,b,21);
+            rpk_put(&out,dec.cache,sizeof(dec.cache));
+        }
+        if (rpk_decode_row(&dec,&in,row,desc.width)) goto cleanup;
+    }
+    rpk_flush(&out);
+    err = out.err ? -1 : 0;
+
+    cleanup:
+        free(row);
+        free(out.buf);
+        if (outf && fclose(outf)) err = -1;
+        rpk_reader_free(&in);
+        return err;
+}
+
+/* Load the sidecar index at path into idx. Returns 0 on success, -1 if it
+ * can't be read or is malformed. */
+int rpk_index_read(rpk_index *idx, const char *path) {
+    FILE *f = fopen(path,"rb");
+    rpk_reader in;
+    rpk_checkpoint *cp;
+    uint8_t b[RPK_INDEX_HEADER_SIZE];
+    uint32_t temp, i;
+    int err = -1;
+
+    memset(idx,0,sizeof(*idx));
+    if (!f||rpk_reader_init(&in,f)) {
+        if (f) fclose(f);
+        return -1;
+    }
+    if (rpk_get(&in,b,RPK_INDEX_HEADER_SIZE)||memcmp(b,"rpki",4)) goto cleanup;
+    idx->size = rpk_get64(b+4);
+    memcpy(&temp,b+12,4);
+    idx->desc.width = ntohl(temp);
+    memcpy(&temp,b+16,4);
+    idx->desc.height = ntohl(temp);
+    idx->desc.channels = b[20];
+    memcpy(&temp,b+21,4);
+    idx->every = ntohl(temp);
+    memcpy(&temp,b+25,4);
+    idx->count = ntohl(temp);
+    if (!idx->every||idx->count!=idx->desc.height/idx->every+(idx->desc.height%idx->every!=0)||
+        (idx->desc.channels!=3&&idx->desc.channels!=4)||!(idx->points = malloc((size_t)idx->count*sizeof(*cp)+1))) {
+        goto cleanup;
+    }
+    for (i=0;i<idx->count;i++) {
+        cp = idx->points+i;
+        rpk_decoder_init(&cp->dec,idx->desc.channels);
+        if (rpk_get(&in,b,21)||rpk_get(&in,cp->dec.cache,sizeof(cp->dec.cache))) goto cleanup;
+        cp->offset = rpk_get64(b);
+        memcpy(&temp,b+8,4);
+        cp->row = ntohl(temp);
+        memcpy(&temp,b+12,4);
+        cp->dec.run = ntohl(temp);
+        cp->dec.runtype = b[16];
+        memcpy(&cp->dec.current,b+17,4);
+        //Anything else can't have come from the decoder
+        if (cp->row!=i*idx->every||cp->offset<RPK_HEADER_SIZE||cp->offset>idx->size||
+            cp->dec.runtype>3||cp->dec.run>(cp->dec.runtype ? 32 : RPK_MAX_RUN)) {
+            goto cleanup;
+        }
+    }
+    err = 0;
+
+    cleanup:
+        rpk_reader_free(&in);
+        fclose(f);
+        if (err) rpk_index_free(idx);
+        return err;
+}
+
+//Check that idx was built for the file of len bytes with header desc
+static int rpk_index_check(const rpk_index *idx, const rpk_desc *desc, size_t len) {
+    return idx->size!=len||idx->desc.width!=desc->width||idx->desc.height!=desc->height||
+           idx->desc.channels!=desc->channels||desc->colorspace&(RPK_STRIPED|RPK_TILED) ? -1 : 0;
+}
+
+/* Decode rows rows starting at row y of the in-memory .rpk file of len bytes
+ * into pixels, stride bytes apart, going through at most idx->every-1 rows
+ * before y. idx is the file's sidecar index, or NULL for a striped file. */
+int rpk_decode_rows(const void *data, size_t len, const rpk_index *idx, uint32_t y, uint32_t rows, void *pixels, size_t stride) {
+    rpk_reader in = {data,(const uint8_t *)data+len};
+    rpk_checkpoint *cps = NULL;
+    const rpk_checkpoint *cp;
+    rpk_desc desc;
+    size_t end = len;
+    uint32_t every;
+    int err;
+
+    if (rpk_read_header(&in,&desc)||y>desc.height||rows>desc.height-y||stride<(size_t)desc.width*desc.channels) {
+        return -1;
+    }
+    if (idx) {
+        if (rpk_index_check(idx,&desc,len)) return -1;
+        every = idx->every;
+        cp = idx->points+y/every;
+    } else {
+        if (!desc.stripe_rows||!(cps = rpk_stripe_checkpoints(data,len,&desc,&end))) return -1;
+        every = desc.stripe_rows;
+        cp = cps+y/every;
+    }
+    err = rows ? rpk_decode_from(data,end,cp,&desc,y-cp->row,pixels,stride,rows) : 0;
+    free(cps);
+    return err;
+}
+
+/* PNG writer for RPK_PARALLEL_DEFLATE, done pigz style: the image is cut into
+ * blocks of whole rows, and each block is filtered and raw-deflated on its own
+ * by the pool. Every block but the last ends in a sync flush, so the
+ * compressed blocks are byte aligned and concatenate into one zlib stream.
+ * The Adler-32s of the blocks are combined for the stream trailer. Blocks do
+ * not share a dictionary (miniz cannot preset one), which costs a little
+ * compression at each block boundary. */
+typedef struct {
+    rpk_job job;
+    uint8_t *raw;       //decoded rows
+    uint8_t *prev;      //the row above the first one, zeros at the top of the image
+    uint8_t *filtered;  //filter type byte + filtered row, for each row
+    uint8_t *trial;     //scratch for picking filters, 2 rows
+    uint8_t *out;       //2 bytes room for the zlib header, deflate data, 4 bytes room for the Adler-32
+    size_t outcap;
+    size_t outlen;
+    size_t rows;
+    size_t rowlen;
+    uint8_t bpp;
+    int last;
+    int err;
+    uint32_t adler;
+    const rpk_desc *desc;       //with start set, the block decodes its own rows
+    const uint8_t *data;        //from the mapped file of len bytes at data,
+    size_t len;
+    const rpk_checkpoint *start;//beginning at this checkpoint
+} rpk_deflate_block;
+
+static uint8_t rpk_paeth(int a, int b, int c) {
+    int p = a+b-c;
+    int pa = abs(p-a), pb = abs(p-b), pc = abs(p-c);
+    if (pa<=pb && pa<=pc) return a;
+    return pb<=pc ? b : c;
+}
+
+/* Filter one row into dst (filter byte first), picking the filter with the
+ * smallest sum of absolute values like libspng's default heuristic. Without
+ * prev, only the filters that don't look at the row above are tried. */
+static void rpk_png_filter_row(uint8_t *dst, const uint8_t *row, const uint8_t *prev, size_t len, uint8_t bpp, uint8_t *trial) {
+    uint8_t *best = trial, *cur = trial+len, *t;
+    unsigned long sum, bestsum = -1;
+    uint8_t bestf = 0;
+    size_t i;
+    int f;
+
+    for (f=0;f<(prev ? 5 : 2);f++) {
+        switch (f) {
+            case 0:
+                memcpy(cur,row,len);
+                break;
+            case 1:
+                for (i=0;i<bpp;i++) cur[i] = row[i];
+                for (;i<len;i++) cur[i] = row[i]-row[i-bpp];
+                break;
+            case 2:
+                for (i=0;i<len;i++) cur[i] = row[i]-prev[i];
+                break;
+            case 3:
+                for (i=0;i<bpp;i++) cur[i] = row[i]-(prev[i]>>1);
+                for (;i<len;i++) cur[i] = row[i]-((row[i-bpp]+prev[i])>>1);
+                break;
+            case 4:
+                for (i=0;i<bpp;i++) cur[i] = row[i]-prev[i];
+                for (;i<len;i++) cur[i] = row[i]-rpk_paeth(row[i-bpp],prev[i],prev[i-bpp]);
+                break;
+        }
+        sum = 0;
+        for (i=0;i<len;i++) sum += cur[i]<128 ? cur[i] : 256-cur[i];
+        if (sum<bestsum) {
+            bestsum = sum;
+            bestf = f;
+            t = best;
+            best = cur;
+            cur = t;
+        }
+    }
+    dst[0] = bestf;
+    memcpy(dst+1,best,len);
+}
+
+static void rpk_deflate_block_run(rpk_job *job) {
+    rpk_deflate_block *b = (rpk_deflate_block *)job;
+    size_t n = b->rows*(b->rowlen+1);
+    //The row above a block that decodes itself may not be decoded yet
+    const uint8_t *prev = b->start ? NULL : b->prev;
+    mz_stream s;
+    size_t y;
+    int ret;
+
+    if (b->start && rpk_decode_from(b->data,b->len,b->start,b->desc,0,b->raw,b->rowlen,b->rows)) {
+        b->err = 1;
+        return;
+    }
+    for (y=0;y<b->rows;y++) {
+        rpk_png_filter_row(b->filtered+y*(b->rowlen+1),b->raw+y*b->rowlen,prev,b->rowlen,b->bpp,b->trial);
+        prev = b->raw+y*b->rowlen;
+    }
+    b->adler = mz_adler32(1,b->filtered,n);
+
+    memset(&s,0,sizeof(s));
+    if (mz_deflateInit2(&s,MZ_DEFAULT_LEVEL,MZ_DEFLATED,-MZ_DEFAULT_WINDOW_BITS,9,MZ_FILTERED)!=MZ_OK) {
+        b->err = 1;
+        return;
+    }
+    s.next_in = b->filtered;
+    s.avail_in = n;
+    s.next_out = b->out+2;
+    s.avail_out = b->outcap-6;
+    ret = mz_deflate(&s,b->last ? MZ_FINISH : MZ_SYNC_FLUSH);
+    b->err = b->last ? ret!=MZ_STREAM_END : ret!=MZ_OK||s.avail_in||!s.avail_out;
+    b->outlen = s.total_out;
+    mz_deflateEnd(&s);
+}
+
+//Adler-32 of two concatenated pieces from the Adler-32s of each (as zlib's adler32_combine)
+static uint32_t rpk_adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+    const uint32_t base = 65521;
+    uint32_t rem = len2%base;
+    uint32_t sum1 = adler1&0xFFFF;
+    uint32_t sum2 = rem*sum1%base;
+    sum1 += (adler2&0xFFFF)+base-1;
+    sum2 += (adler1>>16)+(adler2>>16)+base-rem;
+    if (sum1>=base) sum1 -= base;
+    if (sum1>=base) sum1 -= base;
+    if (sum2>=base<<1) sum2 -= base<<1;
+    if (sum2>=base) sum2 -= base;
+    return sum1|sum2<<16;
+}
+
+static int rpk_png_chunk(FILE *f, const char *type, const uint8_t *data, size_t len) {
+    uint32_t temp = htonl(len);
+    uint32_t crc = mz_crc32(mz_crc32(0,(const uint8_t *)type,4),data,len);
+    if (fwrite(&temp,1,4,f)!=4||fwrite(type,1,4,f)!=4||fwrite(data,1,len,f)!=len) return -1;
+    temp = htonl(crc);
+    return fwrite(&temp,1,4,f)!=4;
+}
+
+//PNG signature and IHDR for desc
+static int rpk_png_header(FILE *f, const rpk_desc *desc) {
+    uint8_t ihdr[13];
+    uint32_t temp;
+    temp = htonl(desc->width);
+    memcpy(ihdr,&temp,4);
+    temp = htonl(desc->height);
+    memcpy(ihdr+4,&temp,4);
+    ihdr[8] = 8;
+    ihdr[9] = 4*desc->channels-10;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    return fwrite("\x89PNG\r\n\x1a\n",1,8,f)!=8||rpk_png_chunk(f,"IHDR",ihdr,13);
+}
+
+//rpk_decode_png_parallel's state for rpk_pool_run
+typedef struct {
+    rpk_reader *in;
+    const rpk_desc *desc;
+    rpk_decoder dec;
+    rpk_tile_rows tiles;
+    const rpk_checkpoint *points;   //with points the blocks decode their own rows,
+    uint32_t every;                 //one every so many rows,
+    size_t end;                     //from the first end bytes of the mapped file
+    rpk_deflate_block *blocks;
+    size_t slots;
+    size_t block_rows;
+    size_t nblocks;
+    FILE *outf;
+    size_t *outlen;
+    uint32_t adler;
+} rpk_deflate_run;
+
+//Decode the block's rows, unless it decodes them itself
+static int rpk_deflate_fill(void *arg, rpk_job *job, size_t i) {
+    rpk_deflate_run *r = arg;
+    rpk_deflate_block *b = (rpk_deflate_block *)job;
+    size_t y;
+
+    b->rows = MIN(r->block_rows,r->desc->height-i*r->block_rows);
+    b->last = i==r->nblocks-1;
+    if (r->points) {
+        b->desc = r->desc;
+        b->data = r->in->buf;
+        b->len = r->end;
+        b->start = r->points+i*(r->block_rows/r->every);
+        return 0;
+    }
+    for (y=0;y<b->rows;y++) {
+        if (r->tiles.dec ? rpk_tile_rows_next(&r->tiles,b->raw+y*b->rowlen) :
+                           rpk_decode_row(&r->dec,r->in,b->raw+y*b->rowlen,r->desc->width)) {
+            return 1;
+        }
+    }
+    if (i) {
+        memcpy(b->prev,r->blocks[(i-1)%r->slots].raw+(r->block_rows-1)*b->rowlen,b->rowlen);
+    } else {
+        memset(b->prev,0,b->rowlen);
+    }
+    return 0;
+}
+
+//Write out the block as soon as it is compressed
+static int rpk_deflate_finish(void *arg, rpk_job *job, size_t i) {
+    rpk_deflate_run *r = arg;
+    rpk_deflate_block *b = (rpk_deflate_block *)job;
+    uint32_t temp;
+
+    if (b->err) return 1;
+    if (!i) {
+        //zlib header: deflate, 32K window, default level
+        b->out[0] = 0x78;
+        b->out[1] = 0x9C;
+    }
+    r->adler = i ? rpk_adler32_combine(r->adler,b->adler,b->rows*(b->rowlen+1)) : b->adler;
+    if (b->last) {
+        temp = htonl(r->adler);
+        memcpy(b->out+2+b->outlen,&temp,4);
+        b->outlen += 4;
+    }
+    *r->outlen += b->rows*b->rowlen;
+    return i ? rpk_png_chunk(r->outf,"IDAT",b->out+2,b->outlen) : rpk_png_chunk(r->outf,"IDAT",b->out,b->outlen+2);
+}
+
+int rpk_decode_png_parallel(rpk_reader *in, const rpk_desc *desc, const rpk_index *idx, FILE *outf, unsigned threads, size_t *outlen) {
+    rpk_deflate_run run = {in,desc};
+    rpk_deflate_block *b;
+    size_t rowlen = (size_t)desc->width*desc->channels;
+    rpk_checkpoint *cps = NULL;
+    size_t i;
+    int err = 0;
+    *outlen = 0;
+
+    //Nothing to deflate: an empty zlib stream (a final empty fixed block and an Adler-32 of 1)
+    if (!rowlen||!desc->height) {
+        return rpk_png_header(outf,desc)||rpk_png_chunk(outf,"IDAT",(const uint8_t *)"\x78\x9C\x03\x00\x00\x00\x00\x01",8)||
+               rpk_png_chunk(outf,"IEND",(const uint8_t *)"",0) ? -1 : 0;
+    }
+    run.block_rows = MIN(desc->height,MAX(1,RPK_DEFLATE_BLOCK/rowlen));
+    run.end = in->cap;
+
+    //With checkpoints into a mapped file the jobs decode too, starting a block at every so many
+    if (in->mapped && desc->stripe_rows) {
+        if (!(run.points = cps = rpk_stripe_checkpoints(in->buf,in->cap,desc,&run.end))) return -1;
+        run.every = desc->stripe_rows;
+    } else if (in->mapped && idx) {
+        if (rpk_index_check(idx,desc,in->cap)) return -1;
+        run.points = idx->points;
+        run.every = idx->every;
+    } else if (desc->tile_width && rpk_tile_rows_init(&run.tiles,in,desc)) {
+        return -1;
+    }
+    if (run.points) run.block_rows = MIN(desc->height,run.every*MAX(1,RPK_DEFLATE_BLOCK/(rowlen*run.every)));
+    run.nblocks = (desc->height+run.block_rows-1)/run.block_rows;
+    threads = rpk_threads(threads);
+    run.slots = MIN(2*threads,run.nblocks);
+    run.outf = outf;
+    run.outlen = outlen;
+    if (!(run.blocks = calloc(run.slots,sizeof(*run.blocks)))) {
+        free(cps);
+        rpk_tile_rows_free(&run.tiles);
+        return -1;
+    }
+    for (i=0;i<run.slots;i++) {
+        b = run.blocks+i;
+        b->rowlen = rowlen;
+        b->bpp = desc->channels;
+        b->outcap = mz_deflateBound(NULL,run.block_rows*(rowlen+1))+16;
+        b->raw = rpk_alloc(run.block_rows*rowlen);
+        b->prev = rpk_alloc(rowlen);
+        b->filtered = rpk_alloc(run.block_rows*(rowlen+1));
+        b->trial = rpk_alloc(2*rowlen);
+        b->out = rpk_alloc(b->outcap);
+        if (!b->raw||!b->prev||!b->filtered||!b->trial||!b->out) err = 1;
+        b->job.run = rpk_deflate_block_run;
+    }
+
+    rpk_decoder_init(&run.dec,desc->channels);
+    run.dec.stripe_rows = desc->stripe_rows;
+    if (!err) err = rpk_png_header(outf,desc);
+    if (!err) err = rpk_pool_run(threads,run.nblocks,run.blocks,run.slots,sizeof(*run.blocks),rpk_deflate_fill,rpk_deflate_finish,&run);
+    if (!err) err = rpk_png_chunk(outf,"IEND",(const uint8_t *)"",0);
+
+    for (i=0;i<run.slots;i++) {
+        b = run.blocks+i;
+        free(b->raw);
+        free(b->prev);
+        free(b->filtered);
+        free(b->trial);
+        free(b->out);
+    }
+    free(run.blocks);
+    free(cps);
+    rpk_tile_rows_free(&run.tiles);
+    return err ? -1 : 0;
+}
+
+/* Encode pixels already in memory, bypassing libspng. pixels points to height rows
+ * of width pixels, each row starting stride bytes after the previous one, with
+ * channels (3 or 4) bytes per pixel in RGB(A) order. Returns a malloc'd buffer
+ * holding the complete .rpk file and stores its size in *outlen, or NULL on failure.
+ * With opts->stripe_rows set, a striped file is encoded on opts->threads threads;
+ * with RPK_PARALLEL_ENCODE in opts->flags, a single stream is. opts->tile_width
+ * and tile_height ask for a tiled file instead. */
+uint8_t *rpk_encode_pixels_ex(const void *pixels, uint32_t width, uint32_t height, size_t stride, uint8_t channels,
+                              const rpk_opts *opts, size_t *outlen) {
+    rpk_writer out;
+    rpk_encoder enc;
+    rpk_desc desc = {width,height,channels,RPK_SRBG};
+    uint32_t y;
+
+    if (!pixels||!width||!height||channels<3||channels>4||stride<(size_t)width*channels) {
+        return NULL;
+    }
+    
+    if (opts && (opts->tile_width||opts->tile_height) && (!opts->tile_width||!opts->tile_height||opts->stripe_rows)) {
+        return NULL;
+    }
+    if (rpk_writer_init(&out,NULL)) {
+        return NULL;
+    }
+    if (opts && opts->tile_width) {
+        desc.colorspace |= RPK_TILED;
+        desc.tile_width = opts->tile_width;
+        desc.tile_height = opts->tile_height;
+        rpk_write_header(&out,&desc);
+        if (rpk_encode_tiles(&out,&desc,NULL,pixels,stride)) out.err = 1;
+    } else if (opts && opts->stripe_rows) {
+        desc.colorspace |= RPK_STRIPED;
+        desc.stripe_rows = opts->stripe_rows;
+        rpk_write_header(&out,&desc);
+        if (rpk_encode_stripes(&out,&desc,NULL,pixels,stride,opts->threads)) out.err = 1;
+    } else if (opts && opts->flags&RPK_PARALLEL_ENCODE) {
+        rpk_write_header(&out,&desc);
+        if (rpk_encode_parallel(&out,&desc,NULL,pixels,stride,opts->threads)) out.err = 1;
+        rpk_write_footer(&out);
+    } else {
+        rpk_write_header(&out,&desc);
+        rpk_encoder_init(&enc,&out,channels);
+        for (y=0;y<height;y++) {
+            rpk_encode_row(&enc,(const uint8_t *)pixels+y*stride,width);
+        }
+        rpk_encode_finish(&enc);
+        rpk_write_footer(&out);
+    }
+    
+    if (out.err) {
+        free(out.buf);
+        return NULL;
+    }
+    *outlen = out.pos;
+    return out.buf;
+}
+
+uint8_t *rpk_encode_pixels(const void *pixels, uint32_t width, uint32_t height, size_t stride, uint8_t channels, size_t *outlen) {
+    return rpk_encode_pixels_ex(pixels,width,height,stride,channels,NULL,outlen);
+}
+
+//Read the header of an in-memory .rpk file, e.g. to size the buffer for rpk_decode_pixels
+int rpk_decode_header(const void *data, size_t len, rpk_desc *desc) {
+    rpk_reader in = {data,(const uint8_t *)data+len};
+    return rpk_read_header(&in,desc);
+}
+
+/* Decode an in-memory .rpk file of len bytes into pixels, bypassing libspng.
+ * Rows of desc->width pixels with desc->channels bytes each are written stride
+ * bytes apart; pixels must hold desc->height such rows. Fills in *desc and
+ * returns 0 on success, -1 if the data is not a valid .rpk file. The stripes
+ * of a striped file, or the stretches between the checkpoints of the sidecar
+ * index opts->index, are decoded on opts->threads threads, unless that is 1.
+ * Without opts everything is decoded on the calling thread. Tiled files are
+ * decoded tile by tile. */
+int rpk_decode_pixels_ex(const void *data, size_t len, void *pixels, size_t stride, rpk_desc *desc, const rpk_opts *opts) {
+    rpk_reader in = {data,(const uint8_t *)data+len};
+    rpk_decoder dec;
+    rpk_checkpoint *cps;
+    rpk_index idx;
+    unsigned threads = opts ? opts->threads : 1;
+    size_t end;
+    uint32_t y;
+    int err;
+
+    if (rpk_read_header(&in,desc)||stride<(size_t)desc->width*desc->channels) {
+        return -1;
+    }
+    if (desc->tile_width) {
+        return rpk_decode_tiles(data,len,pixels,stride,desc);
+    }
+    if (threads!=1 && desc->stripe_rows && desc->stripe_rows<desc->height) {
+        if (!(cps = rpk_stripe_checkpoints(data,len,desc,&end))) return -1;
+        err = rpk_decode_segments(data,end,cps,rpk_stripe_count(desc),desc->stripe_rows,pixels,stride,desc,threads);
+        free(cps);
+        return err;
+    }
+    if (threads!=1 && opts && opts->index && desc->height) {
+        if (rpk_index_read(&idx,opts->index)) return -1;
+        err = rpk_index_check(&idx,desc,len) ? -1 :
+              rpk_decode_segments(data,len,idx.points,idx.count,idx.every,pixels,stride,desc,threads);
+        rpk_index_free(&idx);
+        return err;
+    }
+    
+    rpk_decoder_init(&dec,desc->channels);
+    dec.stripe_rows = desc->stripe_rows;
+    for (y=0;y<desc->height;y++) {
+        if (rpk_decode_row(&dec,&in,(uint8_t *)pixels+y*stride,desc->width)) return -1;
+    }
+    return 0;
+}
+
+int rpk_decode_pixels(const void *data, size_t len, void *pixels, size_t stride, rpk_desc *desc) {
+    return rpk_decode_pixels_ex(data,len,pixels,stride,desc,NULL);
+}
+
+
+//Set up a libspng decoder reading from inf
+static spng_ctx *rpk_png_decoder(FILE *inf) {
+    size_t limit = 1024 * 1024 * 64;
+    spng_ctx *ctx = spng_ctx_new(0);
+
+    if (!ctx) {
+        return NULL;
+    }
+
+    // Ignore and don't calculate chunk CRC's
+    spng_set_crc_action(ctx, SPNG_CRC_USE, SPNG_CRC_USE);    
+
+    /* Set memory usage limits for storing standard and unknown chunks,
+       this is important when reading untrusted files! */
+    spng_set_chunk_limits(ctx, limit, limit);
+
+    // Set source PNG
+    spng_set_png_file(ctx, inf);
+    return ctx;
+}
+
+/* Check whether a PNG with an alpha channel has alpha 255 everywhere.
+ * No chunk can promise that for color types with alpha (tRNS is not allowed
+ * there and sBIT only states precision), so this decodes the image and stops
+ * at the first translucent pixel. Leaves inf rewound. */
+static int rpk_png_opaque(FILE *inf) {
+    spng_ctx *ctx = rpk_png_decoder(inf);
+    struct spng_ihdr ihdr;
+    size_t byte_len, i, width;
+    uint8_t *row = NULL;
+    int ret, opaque = 0;
+
+    if (!ctx||spng_get_ihdr(ctx, &ihdr)||!(ihdr.color_type&4)||
+        spng_decoded_image_size(ctx, SPNG_FMT_RGBA8, &byte_len)||
+        spng_decode_image(ctx, NULL, 0, SPNG_FMT_RGBA8, SPNG_DECODE_PROGRESSIVE)) {
+        goto done;
+    }
+    width = byte_len / (4*ihdr.height);
+    if (!(row = rpk_alloc(4*width))) {
+        goto done;
+    }
+    
+    do {
+        ret = spng_decode_row(ctx, row, 4*width);
+        if (ret && ret != SPNG_EOI) goto done;
+        for (i=3;i<4*width;i+=4) {
+            if (row[i]!=255) goto done;
+        }
+    } while (!ret);
+    opaque = 1;
+
+    done:
+        free(row);
+        spng_ctx_free(ctx);
+        rewind(inf);
+        return opaque;
+}
+
+size_t rpk_write_ex(const char *infile, const char *outfile, const rpk_opts *opts) {
+    unsigned flags = opts ? opts->flags : 0;
+    FILE *inf;
+	FILE *outf;
+	size_t size, width;
+    size_t byte_len;
+    int fmt;
+    int opaque = 0;
+    rpk_desc desc;
+    rpk_writer out = {0};
+    spng_ctx *ctx = NULL;
+    
+    inf = fopen(infile,"rb");
+    outf = fopen(outfile,"wb");
+    if (!inf||!outf) {
+		goto error;
+	}
+
+    if (flags&RPK_DETECT_OPAQUE) {
+        opaque = rpk_png_opaque(inf);
+    }
+
+    ctx = rpk_png_decoder(inf);
+
+    if (!ctx) {
+        goto error;
+    }
+
+    struct spng_ihdr ihdr;
+
+    if (spng_get_ihdr(ctx, &ihdr)) {
+        goto error;
+    }
+    desc.channels = opaque ? 3 : 3+(ihdr.color_type>>2&1);
+    //Have libspng hand over 3-byte pixels for sources without (meaningful) alpha
+    fmt = desc.channels==3 ? SPNG_FMT_RGB8 : SPNG_FMT_RGBA8;
+    
+    if (spng_decoded_image_size(ctx, fmt, &byte_len)||
+        spng_decode_image(ctx, NULL, 0, fmt, SPNG_DECODE_PROGRESSIVE)) {
+        goto error;
+    }
+    
+    
+    width = byte_len / (desc.channels*ihdr.height);
+    
+    //Construct description
+    desc.width = width;
+    desc.height = ihdr.height;
+    //since we're just converting from png, probably safe to assume sRBG colorspace
+    desc.colorspace = RPK_SRBG;
+    desc.stripe_rows = opts ? opts->stripe_rows : 0;
+    if (desc.stripe_rows) desc.colorspace |= RPK_STRIPED;
+    desc.tile_width = opts ? opts->tile_width : 0;
+    desc.tile_height = opts ? opts->tile_height : 0;
+    if (desc.tile_width||desc.tile_height) {
+        if (!desc.tile_width||!desc.tile_height||desc.stripe_rows) {
+            goto error;
+        }
+        desc.colorspace |= RPK_TILED;
+    }
+    
+    
+    
+    //Write file header
+    if (rpk_writer_init(&out,outf)) {
+        goto error;
+    }
+    rpk_write_header(&out,&desc);
+
+    if (desc.tile_width) {
+        //Writes the tile directory and footer too
+        if (rpk_encode_tiles(&out, &desc, ctx, NULL, 0)) {
+            goto error;
+        }
+        size = out.flushed+out.pos-RPK_TILED_HEADER_SIZE;
+    } else if (desc.stripe_rows) {
+        //Writes the stripe table and footer too
+        if (rpk_encode_stripes(&out, &desc, ctx, NULL, 0, opts->threads)) {
+            goto error;
+        }
+        size = out.flushed+out.pos-RPK_STRIPED_HEADER_SIZE;
+    } else {
+        if (flags&RPK_PARALLEL_ENCODE && width && desc.height) {
+            if (rpk_encode_parallel(&out, &desc, ctx, NULL, 0, opts->threads)) {
+                goto error;
+            }
+        } else if ((flags&RPK_THREADED ? rpk_encode_threaded : rpk_encode)(ctx, width, &out, desc.channels)) {
+            goto error;
+        }
+        size = out.flushed+out.pos-RPK_HEADER_SIZE;
+        rpk_write_footer(&out);
+    }
+    rpk_flush(&out);
+    if (out.err) {
+        goto error;
+    }
+    free(out.buf);
+    fclose(outf);
+
+    fclose(inf);
+    
+    spng_ctx_free(ctx);
+	
+	return size;
+    error:
+        free(out.buf);
+        if (inf) fclose(inf);
+        if (outf) fclose(outf);
+        spng_ctx_free(ctx);
+        return -1;
+}
+
+
+size_t rpk_write(const char *infile, const char *outfile) {
+    return rpk_write_ex(infile,outfile,NULL);
+}
+
+
+size_t rpk_read_ex(const char *infile, const char *outfile, const rpk_opts *opts) {
+    unsigned flags = opts ? opts->flags : 0;
+	FILE *inf = NULL;
+    FILE *outf = fopen(outfile, "wb");
+	size_t size;
+    rpk_desc desc;
+    rpk_reader in = {0};
+    rpk_index idx = {0};
+    struct spng_ihdr ihdr = {0};
+    spng_ctx *enc = NULL;
+    int fmt;
+
+    if (!outf) {
+        goto error;
+    }
+    //Only the parallel PNG writer decodes from checkpoints
+    if (opts && opts->index && (!(flags&RPK_PARALLEL_DEFLATE)||rpk_index_read(&idx,opts->index))) {
+        goto error;
+    }
+
+    if (flags&RPK_MMAP||idx.points) {
+        if (rpk_reader_map(&in,infile)) {
+            goto error;
+        }
+    } else if (!(inf = fopen(infile, "rb"))||rpk_reader_init(&in,inf)) {
+        goto error;
+    }
+
+    //Extract desc from header
+    if (rpk_read_header(&in,&desc)) {
+        goto error;
+    }
+    //Rows of tiles are read from all over the file, so tiled files are always mapped
+    if (desc.tile_width && !in.mapped) {
+        rpk_reader_free(&in);
+        fclose(inf);
+        inf = NULL;
+        if (rpk_reader_map(&in,infile)||rpk_read_header(&in,&desc)) {
+            goto error;
+        }
+    }
+    //A stale index, or one for another file, is an error rather than ignored
+    if (idx.points && rpk_index_check(&idx,&desc,in.cap)) {
+        goto error;
+    }
+
+    if (flags&RPK_PARALLEL_DEFLATE) {
+        if (rpk_decode_png_parallel(&in, &desc, opts->index ? &idx : NULL, outf, opts->threads, &size)) {
+            goto error;
+        }
+    } else {
+        enc = spng_ctx_new(SPNG_CTX_ENCODER);
+
+        if (!enc) {
+            goto error;
+        }
+
+        //Create PNG header
+        ihdr.width = desc.width;
+        ihdr.height = desc.height;
+        ihdr.bit_depth = 8;
+        ihdr.color_type = 4*desc.channels-10;
+        
+        if (spng_set_ihdr(enc,&ihdr)) {
+            goto error;
+        }
+        
+        //Set file for context
+        spng_set_png_file(enc,outf);
+        
+        //Encoding format
+        fmt = SPNG_FMT_PNG;
+        
+        
+        if (spng_encode_image(enc, 0, 0, fmt, SPNG_ENCODE_PROGRESSIVE)) {
+            goto error;
+        }
+        if ((flags&RPK_THREADED ? rpk_decode_threaded : rpk_decode)(&in, &desc, enc, &size)) {
+            goto error;
+        }
+    }
+    
+    rpk_reader_free(&in);
+    rpk_index_free(&idx);
+    if (inf) fclose(inf);
+    fclose(outf);
+    spng_ctx_free(enc);
+	return size;
+
+    error:
+        rpk_reader_free(&in);
+        rpk_index_free(&idx);
+        if (inf) fclose(inf);
+        if (outf) fclose(outf);
+        spng_ctx_free(enc);
+        return -1;
+}
+
+size_t rpk_read(const char *infile, const char *outfile) {
+    return rpk_read_ex(infile,outfile,NULL);
+}
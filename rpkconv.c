@@ -1,30 +1,108 @@
-#include "rpk.h"
-#include <stdlib.h>
-
-
-#define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
-
-
-int main(int argc, char **argv) {
-	if (argc<3) {
-        printf("Usage: %s infile outfile\n",argv[0]);
-        return 1;
-    }
-    
-    
-	if (STR_ENDS_WITH(argv[1], ".png")) {
-        //Encode to RPK
-        if (!STR_ENDS_WITH(argv[2], ".rpk")) {
-            printf("At least one filename must end with .rpk\n");
-            return 1;
-        }
-        return rpk_write(argv[1],argv[2])<0;
-	} else {
-        //Decode from RPK
-        if (!STR_ENDS_WITH(argv[2], ".png")) {
-            printf("At least one filename must end with .png\n");
-            return 1;
-        }
-        return rpk_read(argv[1],argv[2])<0;
-    }
-}
+#include "rpk.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+
+#define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
+
+
+int main(int argc, char **argv) {
+    rpk_opts opts = {0};
+    uint32_t every = 0;
+    int concat = 0, opt;
+    char *end;
+    
+    while ((opt = getopt(argc, argv, "aceI:i:j:mps:T:t")) != -1) {
+        switch (opt) {
+            case 'a':
+                opts.flags |= RPK_DETECT_OPAQUE;
+                break;
+            case 'c':
+                concat = 1;
+                break;
+            case 'e':
+                opts.flags |= RPK_PARALLEL_ENCODE;
+                break;
+            case 'I':
+                every = atoi(optarg);
+                break;
+            case 'i':
+                opts.index = optarg;
+                break;
+            case 'j':
+                opts.threads = atoi(optarg);
+                break;
+            case 'm':
+                opts.flags |= RPK_MMAP;
+                break;
+            case 'p':
+                opts.flags |= RPK_PARALLEL_DEFLATE;
+                break;
+            case 's':
+                opts.stripe_rows = atoi(optarg);
+                break;
+            case 'T':
+                opts.tile_width = strtoul(optarg,&end,10);
+                opts.tile_height = *end=='x' ? strtoul(end+1,NULL,10) : opts.tile_width;
+                break;
+            case 't':
+                opts.flags |= RPK_THREADED;
+                break;
+            default:
+                argc = 0;
+        }
+    }
+	if (argc-optind<2) {
+        printf("Usage: %s [-aempt] [-i index] [-j threads] [-s rows] [-T WxH] infile outfile\n",argv[0]);
+        printf("       %s -I rows infile.rpk outfile.rpki\n",argv[0]);
+        printf("       %s -c fragment.rpk... outfile.rpk\n",argv[0]);
+        printf("  -a  store RGBA PNGs with no translucent pixels as RGB\n");
+        printf("  -c  join striped fragments holding consecutive rows of one image, without re-encoding\n");
+        printf("  -e  encode .rpk output on several threads, with the same result as without\n");
+        printf("  -I  write a sidecar index with a checkpoint every this many rows\n");
+        printf("  -i  with -p, decode single-stream .rpk input in parallel from this sidecar index, which must match it\n");
+        printf("  -j  worker threads for -e, -p and -s (default: one per CPU)\n");
+        printf("  -m  decode .rpk input through mmap\n");
+        printf("  -p  compress PNG output on several threads (striped input with -m, and indexed input, is decoded there too)\n");
+        printf("  -s  write .rpk output as stripes of this many rows, encoded in parallel\n");
+        printf("  -T  write .rpk output as tiles of W x H pixels (or W x W), each decodable on its own\n");
+        printf("  -t  run PNG coding and RPK coding on separate threads\n");
+        return 1;
+    }
+    argv += optind;
+    
+    
+	if (concat) {
+        //Join the fragments into the last file
+        if (!STR_ENDS_WITH(argv[argc-optind-1], ".rpk")) {
+            printf("The output filename must end with .rpk\n");
+            return 1;
+        }
+        return rpk_concat((const char *const *)argv,argc-optind-1,argv[argc-optind-1])!=0;
+	} else if (STR_ENDS_WITH(argv[1], ".rpki")) {
+        //Index an RPK
+        if (!STR_ENDS_WITH(argv[0], ".rpk") || !every) {
+            printf("Indexing needs -I rows and an .rpk input\n");
+            return 1;
+        }
+        return rpk_index_write(argv[0],argv[1],every)!=0;
+	} else if (STR_ENDS_WITH(argv[0], ".png")) {
+        //Encode to RPK
+        if (!STR_ENDS_WITH(argv[1], ".rpk")) {
+            printf("At least one filename must end with .rpk\n");
+            return 1;
+        }
+        return rpk_write_ex(argv[0],argv[1],&opts)==(size_t)-1;
+	} else {
+        //Decode from RPK
+        if (!STR_ENDS_WITH(argv[1], ".png")) {
+            printf("At least one filename must end with .png\n");
+            return 1;
+        }
+        if (opts.index && !(opts.flags&RPK_PARALLEL_DEFLATE)) {
+            printf("Decoding from an index needs -p\n");
+            return 1;
+        }
+        return rpk_read_ex(argv[0],argv[1],&opts)==(size_t)-1;
+    }
+}